@@ -15,6 +15,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <new>
+#include <lwip/dns.h>
+#include <lwip/tcp.h>
+#include <include/ClientContext.h>
+#include <bearssl/bearssl.h>
+#include <StackThunk.h>
+
 #include "SocksClient.h"
 #include "wifippp.h"
 
@@ -23,7 +30,10 @@ enum {
 	STATE_INIT,
 	STATE_METHOD,
 	STATE_REQUEST,
+	STATE_RESOLVING,
 	STATE_CONNECT,
+	STATE_CONNECTING,
+	STATE_HANDSHAKE,
 	STATE_PROXY,
 };
 
@@ -57,27 +67,263 @@ unsigned int tls_ports[] = {
 #define REPLY_BAD_COMMAND	0x07
 #define REPLY_BAD_ADDRESS	0x08
 
-#define REMOTE_CLIENT		(tls() ? remote_client_tls : remote_client)
+/* how long to wait for a hostname to resolve, connect, and do TLS */
+#define RESOLVE_TIMEOUT		(10 * 1000)
+#define CONNECT_TIMEOUT		(10 * 1000)
+#define HANDSHAKE_TIMEOUT	(15 * 1000)
+
+/*
+ * Proxy buffer sizes.  Uploads want a full segment per write, but with TLS
+ * each write becomes a record in BearSSL's 1024-byte output buffer.
+ * Downloads are paced by the serial link and BearSSL already holds a
+ * decrypted record for us, so TLS sessions need less on that side.
+ */
+#define PROXY_BUF_MIN		256
+#define PROXY_BUF_LOCAL		TCP_MSS
+#define PROXY_BUF_LOCAL_TLS	1024
+#define PROXY_BUF_REMOTE	2048
+#define PROXY_BUF_REMOTE_TLS	512
+/* let one session's buffers have at most this share of free heap */
+#define PROXY_BUF_HEAP_DIVISOR	8
+
+/*
+ * TLS-decrypting sessions drive their own BearSSL client engine over
+ * remote_client, one record at a time from process(), rather than using
+ * WiFiClientSecure, which does its whole handshake in connect().
+ */
+#define TLS_IBUF_SIZE		1024
+#define TLS_OBUF_SIZE		1024
+
+/* like WiFiClientSecure's setInsecure(), take the server's key as-is */
+struct socks_x509 {
+	const br_x509_class *vtable;
+	br_x509_decoder_context dc;
+	bool first;
+};
+
+struct socks_tls {
+	br_ssl_client_context sc;
+	struct socks_x509 x509;
+	unsigned char ibuf[TLS_IBUF_SIZE];
+	unsigned char obuf[TLS_OBUF_SIZE];
+};
+
+static const uint16_t tls_suites[] = {
+	BR_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+	BR_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+	BR_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+	BR_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+	BR_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+	BR_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+	BR_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+	BR_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+	BR_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA,
+	BR_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA,
+	BR_TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA,
+	BR_TLS_ECDHE_RSA_WITH_AES_256_CBC_SHA,
+	BR_TLS_RSA_WITH_AES_128_GCM_SHA256,
+	BR_TLS_RSA_WITH_AES_256_GCM_SHA384,
+	BR_TLS_RSA_WITH_AES_128_CBC_SHA256,
+	BR_TLS_RSA_WITH_AES_256_CBC_SHA256,
+	BR_TLS_RSA_WITH_AES_128_CBC_SHA,
+	BR_TLS_RSA_WITH_AES_256_CBC_SHA,
+};
+
+/*
+ * BearSSL needs more stack than loop() has, so the core runs its engine on
+ * a second stack through these thunks, which WiFiClientSecure also uses.
+ */
+extern "C" {
+unsigned char *thunk_br_ssl_engine_recvapp_buf(const br_ssl_engine_context *,
+    size_t *);
+void thunk_br_ssl_engine_recvapp_ack(br_ssl_engine_context *, size_t);
+unsigned char *thunk_br_ssl_engine_recvrec_buf(const br_ssl_engine_context *,
+    size_t *);
+void thunk_br_ssl_engine_recvrec_ack(br_ssl_engine_context *, size_t);
+unsigned char *thunk_br_ssl_engine_sendapp_buf(const br_ssl_engine_context *,
+    size_t *);
+void thunk_br_ssl_engine_sendapp_ack(br_ssl_engine_context *, size_t);
+unsigned char *thunk_br_ssl_engine_sendrec_buf(const br_ssl_engine_context *,
+    size_t *);
+void thunk_br_ssl_engine_sendrec_ack(br_ssl_engine_context *, size_t);
+}
+
+#define br_ssl_engine_recvapp_buf	thunk_br_ssl_engine_recvapp_buf
+#define br_ssl_engine_recvapp_ack	thunk_br_ssl_engine_recvapp_ack
+#define br_ssl_engine_recvrec_buf	thunk_br_ssl_engine_recvrec_buf
+#define br_ssl_engine_recvrec_ack	thunk_br_ssl_engine_recvrec_ack
+#define br_ssl_engine_sendapp_buf	thunk_br_ssl_engine_sendapp_buf
+#define br_ssl_engine_sendapp_ack	thunk_br_ssl_engine_sendapp_ack
+#define br_ssl_engine_sendrec_buf	thunk_br_ssl_engine_sendrec_buf
+#define br_ssl_engine_sendrec_ack	thunk_br_ssl_engine_sendrec_ack
+
+/* lets us wrap a pcb we connected ourselves, like WiFiServer does */
+class SocksRemoteClient : public WiFiClient {
+public:
+	SocksRemoteClient(ClientContext *ctx) : WiFiClient(ctx) {}
+};
 
 static unsigned long last_buffer_check = 0;
 
+static void
+x509_start_chain(const br_x509_class **ctx, const char *server_name)
+{
+	struct socks_x509 *x = (struct socks_x509 *)ctx;
+
+	(void)server_name;
+	x->first = true;
+}
+
+static void
+x509_start_cert(const br_x509_class **ctx, uint32_t length)
+{
+	struct socks_x509 *x = (struct socks_x509 *)ctx;
+
+	(void)length;
+	if (x->first)
+		br_x509_decoder_init(&x->dc, NULL, NULL);
+}
+
+static void
+x509_append(const br_x509_class **ctx, const unsigned char *buf, size_t len)
+{
+	struct socks_x509 *x = (struct socks_x509 *)ctx;
+
+	/* only the server's own certificate matters */
+	if (x->first)
+		br_x509_decoder_push(&x->dc, buf, len);
+}
+
+static void
+x509_end_cert(const br_x509_class **ctx)
+{
+	struct socks_x509 *x = (struct socks_x509 *)ctx;
+
+	x->first = false;
+}
+
+static unsigned
+x509_end_chain(const br_x509_class **ctx)
+{
+	struct socks_x509 *x = (struct socks_x509 *)ctx;
+
+	return br_x509_decoder_last_error(&x->dc);
+}
+
+static const br_x509_pkey *
+x509_get_pkey(const br_x509_class *const *ctx, unsigned *usages)
+{
+	struct socks_x509 *x = (struct socks_x509 *)ctx;
+
+	if (usages != NULL)
+		*usages = BR_KEYTYPE_KEYX | BR_KEYTYPE_SIGN;
+	return br_x509_decoder_get_pkey(&x->dc);
+}
+
+static const br_x509_class x509_insecure_vtable = {
+	sizeof(struct socks_x509),
+	x509_start_chain,
+	x509_start_cert,
+	x509_append,
+	x509_end_cert,
+	x509_end_chain,
+	x509_get_pkey,
+};
+
+static bool
+ring_alloc(struct socks_ring *r, size_t size)
+{
+	r->data = (unsigned char *)malloc(size);
+	if (r->data == NULL)
+		return false;
+
+	r->size = size;
+	r->off = 0;
+	r->len = 0;
+	return true;
+}
+
+static void
+ring_free(struct socks_ring *r)
+{
+	if (r->data)
+		free(r->data);
+	memset(r, 0, sizeof(struct socks_ring));
+}
+
+/* contiguous span of buffered data, up to the end of the buffer */
+static size_t
+ring_out(struct socks_ring *r, unsigned char **ptr)
+{
+	size_t len = r->size - r->off;
+
+	*ptr = r->data + r->off;
+	return (r->len < len ? r->len : len);
+}
+
+/* contiguous span of free space after the buffered data */
+static size_t
+ring_in(struct socks_ring *r, unsigned char **ptr)
+{
+	size_t end = (r->off + r->len) % r->size;
+
+	*ptr = r->data + end;
+	if (end < r->off)
+		return r->off - end;
+	return (r->size - end < r->size - r->len ? r->size - end :
+	    r->size - r->len);
+}
+
+static void
+ring_consume(struct socks_ring *r, size_t len)
+{
+	r->len -= len;
+	if (r->len == 0)
+		r->off = 0;
+	else
+		r->off = (r->off + len) % r->size;
+}
+
 SocksClient::~SocksClient()
 {
-	local_client.stop();
-	REMOTE_CLIENT.stop();
+	reset();
+}
+
+SocksClient::SocksClient()
+{
+	state = STATE_DEAD;
+	slot = -1;
+
+	memset(local_buf, 0, sizeof(local_buf));
+	memset(&local_ring, 0, sizeof(local_ring));
+	memset(&remote_ring, 0, sizeof(remote_ring));
+	local_buf_len = 0;
+	remote_port = 0;
+	ip4_addr_set_zero(&remote_ip);
+	remote_hostname[0] = '\0';
+	resolved = false;
+	pcb = NULL;
+	connect_ms = 0;
+	handshake_ms = 0;
+	_tls = false;
+	ssl = NULL;
 }
 
-SocksClient::SocksClient(int _slot, WiFiClient _client)
-    : slot(_slot), local_client(_client)
+/* start a new session in this pooled client */
+void
+SocksClient::begin(int _slot, WiFiClient _client)
 {
+	slot = _slot;
+	local_client = _client;
 	state = STATE_INIT;
 
 	memset(local_buf, 0, sizeof(local_buf));
-	memset(remote_buf, 0, sizeof(remote_buf));
 	local_buf_len = 0;
-	remote_buf_len = 0;
 	remote_port = 0;
 	ip4_addr_set_zero(&remote_ip);
+	remote_hostname[0] = '\0';
+	connect_ms = 0;
+	handshake_ms = 0;
 	_tls = false;
 
 #ifdef SOCKS_TRACE
@@ -86,6 +332,29 @@ SocksClient::SocksClient(int _slot, WiFiClient _client)
 #endif
 }
 
+/* tear down a finished session so the client can be reused */
+void
+SocksClient::reset()
+{
+	/* give up on a connection still in progress */
+	if (pcb != NULL) {
+		tcp_arg(pcb, NULL);
+		tcp_err(pcb, NULL);
+		tcp_abort(pcb);
+		pcb = NULL;
+	}
+
+	local_client.stop();
+	remote_client.stop();
+	/* drop our references to the old connections */
+	local_client = WiFiClient();
+	remote_client = WiFiClient();
+	tls_free();
+	ring_free(&local_ring);
+	ring_free(&remote_ring);
+	state = STATE_DEAD;
+}
+
 bool
 SocksClient::done()
 {
@@ -130,9 +399,18 @@ SocksClient::process()
 	case STATE_REQUEST:
 		handle_request();
 		break;
+	case STATE_RESOLVING:
+		resolve();
+		break;
 	case STATE_CONNECT:
 		connect();
 		break;
+	case STATE_CONNECTING:
+		connecting();
+		break;
+	case STATE_HANDSHAKE:
+		handshake();
+		break;
 	case STATE_PROXY:
 		proxy();
 		break;
@@ -225,6 +503,8 @@ SocksClient::verify_method()
 void
 SocksClient::handle_request()
 {
+	bool resolving = false;
+
 	if (!verify_state(STATE_REQUEST))
 		return;
 
@@ -260,23 +540,22 @@ SocksClient::handle_request()
 
 		break;
 	case REQUEST_ATYP_HOSTNAME: {
-		IPAddress resip;
+		ip_addr_t resip;
 		unsigned char hostlen;
+		err_t err;
 
 		if (local_buf_len < 4 + 2)
 			return;
 
 		hostlen = local_buf[4];
-		if (local_buf_len < (unsigned char)(4 + hostlen + 2))
-			return;
-
-		remote_hostname = (unsigned char *)malloc(hostlen + 1);
-		if (!remote_hostname) {
-			syslog.logf(LOG_ERR, "[%d] malloc(%d) failure",
-			    slot, hostlen + 1);
-			fail_close(REPLY_FAIL);
+		if (hostlen == 0) {
+			syslog.logf(LOG_ERR, "[%d] bad hostname length %d",
+			    slot, hostlen);
+			fail_close(REPLY_BAD_ADDRESS);
 			return;
 		}
+		if (local_buf_len < (size_t)(5 + hostlen + 2))
+			return;
 
 		memcpy(remote_hostname, local_buf + 5, hostlen);
 		remote_hostname[hostlen] = '\0';
@@ -285,8 +564,37 @@ SocksClient::handle_request()
 		remote_port = (uint16_t)((local_buf[5 + hostlen] & 0xff) << 8) |
 		    (local_buf[5 + hostlen + 1] & 0xff);
 
-		if (WiFi.hostByName((const char *)remote_hostname,
-		    resip) != 1) {
+		if (socks_cache_lookup(remote_hostname, &remote_ip)) {
+			if (ip4_addr_isany_val(remote_ip)) {
+				syslog.logf(LOG_ERR, "[%d] CONNECT request to "
+				    "hostname %s:%d, name cached as not "
+				    "resolving", slot, remote_hostname,
+				    remote_port);
+				fail_close(REPLY_BAD_ADDRESS);
+				return;
+			}
+#ifdef SOCKS_TRACE
+			syslog.logf(LOG_DEBUG, "[%d] CONNECT request to "
+			    "hostname %s:%d, cached as IP %s", slot,
+			    remote_hostname, remote_port,
+			    ipaddr_ntoa(&remote_ip));
+#endif
+			break;
+		}
+
+		/*
+		 * Resolve in the background, unless lwIP already has the
+		 * answer cached, and let resolve() pick up the result.
+		 */
+		resolved = false;
+		resolve_start = millis();
+		err = dns_gethostbyname(remote_hostname, &resip, dns_found,
+		    this);
+		if (err == ERR_INPROGRESS) {
+			resolving = true;
+			break;
+		}
+		if (err != ERR_OK || !IP_IS_V4(&resip)) {
 			syslog.logf(LOG_ERR, "[%d] CONNECT request to "
 			    "hostname %s:%d, couldn't resolve name",
 			    slot, remote_hostname, remote_port);
@@ -294,7 +602,8 @@ SocksClient::handle_request()
 			return;
 		}
 
-		ip4_addr_set_u32(&remote_ip, resip.v4());
+		ip4_addr_copy(remote_ip, *ip_2_ip4(&resip));
+		socks_cache_store(remote_hostname, &remote_ip);
 
 #ifdef SOCKS_TRACE
 		syslog.logf(LOG_DEBUG, "[%d] CONNECT request to hostname "
@@ -316,7 +625,7 @@ SocksClient::handle_request()
 
 	switch (local_buf[1]) {
 	case REQUEST_COMMAND_CONNECT:
-		state = STATE_CONNECT;
+		state = resolving ? STATE_RESOLVING : STATE_CONNECT;
 		return;
 	default:
 		syslog.logf(LOG_ERR, "[%d] unsupported command 0x%x",
@@ -326,10 +635,75 @@ SocksClient::handle_request()
 	}
 }
 
+/*
+ * Called from lwIP when a lookup started by handle_request() finishes.
+ * Clients are pooled and never freed, so arg is always valid, but it may
+ * have given up on this lookup and moved on to another session by now.
+ */
+void
+SocksClient::dns_found(const char *name, const ip_addr_t *ipaddr, void *arg)
+{
+	SocksClient *client = (SocksClient *)arg;
+
+	if (client->state != STATE_RESOLVING || client->resolved ||
+	    strcasecmp(name, client->remote_hostname) != 0)
+		return;
+
+	if (ipaddr != NULL && IP_IS_V4(ipaddr))
+		ip4_addr_copy(client->remote_ip, *ip_2_ip4(ipaddr));
+	else
+		ip4_addr_set_zero(&client->remote_ip);
+
+	/* leave talking to the local client to process() */
+	client->resolved = true;
+}
+
+void
+SocksClient::resolve()
+{
+	if (!verify_state(STATE_RESOLVING))
+		return;
+
+	if (!resolved) {
+		if (millis() - resolve_start < RESOLVE_TIMEOUT)
+			return;
+
+		syslog.logf(LOG_ERR, "[%d] CONNECT request to hostname %s:%d, "
+		    "timed out resolving name", slot, remote_hostname,
+		    remote_port);
+		fail_close(REPLY_HOST_UNREACHABLE);
+		return;
+	}
+
+	/* remember failures too, so retries don't go back to the server */
+	socks_cache_store(remote_hostname, &remote_ip);
+
+	if (ip4_addr_isany_val(remote_ip)) {
+		syslog.logf(LOG_ERR, "[%d] CONNECT request to hostname %s:%d, "
+		    "couldn't resolve name", slot, remote_hostname,
+		    remote_port);
+		fail_close(REPLY_BAD_ADDRESS);
+		return;
+	}
+
+#ifdef SOCKS_TRACE
+	syslog.logf(LOG_DEBUG, "[%d] CONNECT request to hostname %s:%d, "
+	    "resolved to IP %s in %lums", slot, remote_hostname, remote_port,
+	    ipaddr_ntoa(&remote_ip), millis() - resolve_start);
+#endif
+
+	state = STATE_CONNECT;
+}
+
+/*
+ * Start connecting to the remote server, leaving lwIP to tell us how it
+ * went, so nothing else has to wait on it.
+ */
 void
 SocksClient::connect()
 {
-	bool ret;
+	ip_addr_t addr;
+	err_t err;
 
 	_tls = false;
 
@@ -350,25 +724,194 @@ SocksClient::connect()
 		}
 	}
 
-	if (tls()) {
-		remote_client_tls.setInsecure();
-		remote_client_tls.setBufferSizes(1024, 1024);
 #ifdef SOCKS_TRACE
-		syslog.logf(LOG_DEBUG, "[%d] making TLS connection to %s:%d "
-		    "with %d free mem", slot, ipaddr_ntoa(&remote_ip),
-		    remote_port, ESP.getFreeHeap());
+	syslog.logf(LOG_DEBUG, "[%d] making %sconnection to %s:%d with %d "
+	    "free mem", slot, (tls() ? "TLS " : ""), ipaddr_ntoa(&remote_ip),
+	    remote_port, ESP.getFreeHeap());
 #endif
+
+	pcb = tcp_new();
+	if (pcb == NULL) {
+		syslog.logf(LOG_ERR, "[%d] tcp_new failed", slot);
+		fail_close(REPLY_FAIL);
+		return;
 	}
 
-	ret = REMOTE_CLIENT.connect(remote_ip, remote_port);
-	if (!ret) {
-		syslog.logf(LOG_WARNING, "[%d] connection to %s:%d%s failed",
-		    slot, ipaddr_ntoa(&remote_ip), remote_port,
+	connect_err = ERR_INPROGRESS;
+	connect_start = millis();
+
+	tcp_arg(pcb, this);
+	tcp_err(pcb, connect_err_cb);
+	ip_addr_copy_from_ip4(addr, remote_ip);
+	err = tcp_connect(pcb, &addr, remote_port, connected_cb);
+	if (err != ERR_OK) {
+		syslog.logf(LOG_WARNING, "[%d] connection to %s:%d failed "
+		    "(%d)", slot, ipaddr_ntoa(&remote_ip), remote_port,
+		    (int)err);
+		socks_stats.connect_fails++;
+		fail_close(REPLY_NET_UNREACHABLE);
+		return;
+	}
+
+	state = STATE_CONNECTING;
+}
+
+/*
+ * Called from lwIP once our SYN is answered.  Hand the pcb to a WiFiClient
+ * right away so anything the server sends first is buffered for us.
+ */
+err_t
+SocksClient::connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err)
+{
+	SocksClient *client = (SocksClient *)arg;
+	ClientContext *ctx;
+
+	(void)err;
+
+	if (client == NULL || client->pcb != tpcb) {
+		tcp_abort(tpcb);
+		return ERR_ABRT;
+	}
+
+	client->pcb = NULL;
+
+	ctx = new (std::nothrow) ClientContext(tpcb, nullptr, nullptr);
+	if (ctx == NULL) {
+		tcp_arg(tpcb, NULL);
+		tcp_err(tpcb, NULL);
+		tcp_abort(tpcb);
+		client->connect_err = ERR_MEM;
+		return ERR_ABRT;
+	}
+
+	client->remote_client = SocksRemoteClient(ctx);
+	client->connect_err = ERR_OK;
+	return ERR_OK;
+}
+
+/* called from lwIP when the connection fails, after it has freed the pcb */
+void
+SocksClient::connect_err_cb(void *arg, err_t err)
+{
+	SocksClient *client = (SocksClient *)arg;
+
+	if (client == NULL)
+		return;
+
+	client->pcb = NULL;
+	client->connect_err = err;
+}
+
+void
+SocksClient::connecting()
+{
+	if (!verify_state(STATE_CONNECTING))
+		return;
+
+	if (connect_err == ERR_INPROGRESS) {
+		if (millis() - connect_start < CONNECT_TIMEOUT)
+			return;
+
+		syslog.logf(LOG_WARNING, "[%d] connection to %s:%d%s timed "
+		    "out", slot, ipaddr_ntoa(&remote_ip), remote_port,
 		    (tls() ? " (TLS decrypt)" : ""));
+		socks_stats.connect_fails++;
+		/* reset() will abort the pcb */
+		fail_close(REPLY_HOST_UNREACHABLE);
+		return;
+	}
+
+	if (connect_err != ERR_OK) {
+		syslog.logf(LOG_WARNING, "[%d] connection to %s:%d%s failed "
+		    "(%d)", slot, ipaddr_ntoa(&remote_ip), remote_port,
+		    (tls() ? " (TLS decrypt)" : ""), (int)connect_err);
+		socks_stats.connect_fails++;
 		fail_close(REPLY_CONN_REFUSED);
 		return;
 	}
 
+	connect_ms = millis() - connect_start;
+	socks_stats.connects++;
+	socks_stats.connect_ms += connect_ms;
+	if (connect_ms > socks_stats.connect_ms_max)
+		socks_stats.connect_ms_max = connect_ms;
+
+#ifdef SOCKS_TRACE
+	syslog.logf(LOG_DEBUG, "[%d] connected to %s:%d in %lums", slot,
+	    ipaddr_ntoa(&remote_ip), remote_port, connect_ms);
+#endif
+
+	if (!tls()) {
+		established();
+		return;
+	}
+
+	if (!tls_start()) {
+		socks_stats.handshake_fails++;
+		fail_close(REPLY_FAIL);
+		return;
+	}
+
+	handshake_start = millis();
+	state = STATE_HANDSHAKE;
+}
+
+void
+SocksClient::handshake()
+{
+	unsigned st;
+
+	if (!verify_state(STATE_HANDSHAKE))
+		return;
+
+	if (!tls_pump()) {
+		syslog.logf(LOG_WARNING, "[%d] TLS handshake with %s:%d "
+		    "failed (%d)", slot, ipaddr_ntoa(&remote_ip), remote_port,
+		    br_ssl_engine_last_error(&ssl->sc.eng));
+		socks_stats.handshake_fails++;
+		fail_close(REPLY_FAIL);
+		return;
+	}
+
+	st = br_ssl_engine_current_state(&ssl->sc.eng);
+	if (!(st & BR_SSL_SENDAPP)) {
+		if (remote_client.connected() &&
+		    millis() - handshake_start < HANDSHAKE_TIMEOUT)
+			return;
+
+		syslog.logf(LOG_WARNING, "[%d] TLS handshake with %s:%d %s",
+		    slot, ipaddr_ntoa(&remote_ip), remote_port,
+		    (remote_client.connected() ? "timed out" :
+		    "closed by server"));
+		socks_stats.handshake_fails++;
+		fail_close(REPLY_FAIL);
+		return;
+	}
+
+	handshake_ms = millis() - handshake_start;
+	socks_stats.handshakes++;
+	socks_stats.handshake_ms += handshake_ms;
+	if (handshake_ms > socks_stats.handshake_ms_max)
+		socks_stats.handshake_ms_max = handshake_ms;
+
+#ifdef SOCKS_TRACE
+	syslog.logf(LOG_DEBUG, "[%d] TLS handshake with %s:%d done in %lums "
+	    "with %d free mem", slot, ipaddr_ntoa(&remote_ip), remote_port,
+	    handshake_ms, ESP.getFreeHeap());
+#endif
+
+	established();
+}
+
+/* the remote end is ready, tell the client and start proxying */
+void
+SocksClient::established()
+{
+	if (!alloc_rings()) {
+		fail_close(REPLY_FAIL);
+		return;
+	}
+
 	unsigned char msg[] = {
 		VERSION_SOCKS5, REPLY_SUCCESS, 0, REQUEST_ATYP_IP,
 		ip4_addr1(&remote_ip), ip4_addr2(&remote_ip),
@@ -382,98 +925,340 @@ SocksClient::connect()
 	state = STATE_PROXY;
 }
 
+bool
+SocksClient::tls_start()
+{
+	br_ssl_engine_context *eng;
+
+	ssl = (struct socks_tls *)malloc(sizeof(struct socks_tls));
+	if (ssl == NULL) {
+		syslog.logf(LOG_ERR, "[%d] malloc(%d) failure", slot,
+		    sizeof(struct socks_tls));
+		return false;
+	}
+	memset(ssl, 0, sizeof(struct socks_tls));
+	stack_thunk_add_ref();
+
+	/* what br_ssl_client_init_full() does, minus the X.509 validator */
+	br_ssl_client_zero(&ssl->sc);
+	eng = &ssl->sc.eng;
+	br_ssl_engine_add_flags(eng, BR_OPT_NO_RENEGOTIATION);
+	br_ssl_engine_set_versions(eng, BR_TLS10, BR_TLS12);
+	br_ssl_engine_set_suites(eng, tls_suites,
+	    sizeof(tls_suites) / sizeof(tls_suites[0]));
+	br_ssl_client_set_default_rsapub(&ssl->sc);
+	br_ssl_engine_set_default_rsavrfy(eng);
+	br_ssl_engine_set_default_ecdsa(eng);
+	br_ssl_engine_set_hash(eng, br_md5_ID, &br_md5_vtable);
+	br_ssl_engine_set_hash(eng, br_sha1_ID, &br_sha1_vtable);
+	br_ssl_engine_set_hash(eng, br_sha224_ID, &br_sha224_vtable);
+	br_ssl_engine_set_hash(eng, br_sha256_ID, &br_sha256_vtable);
+	br_ssl_engine_set_hash(eng, br_sha384_ID, &br_sha384_vtable);
+	br_ssl_engine_set_hash(eng, br_sha512_ID, &br_sha512_vtable);
+	br_ssl_engine_set_prf10(eng, &br_tls10_prf);
+	br_ssl_engine_set_prf_sha256(eng, &br_tls12_sha256_prf);
+	br_ssl_engine_set_prf_sha384(eng, &br_tls12_sha384_prf);
+	br_ssl_engine_set_default_aes_cbc(eng);
+	br_ssl_engine_set_default_aes_gcm(eng);
+	br_ssl_engine_set_default_chapol(eng);
+
+	ssl->x509.vtable = &x509_insecure_vtable;
+	br_ssl_engine_set_x509(eng, &ssl->x509.vtable);
+	br_ssl_engine_set_buffers_bidi(eng, ssl->ibuf, sizeof(ssl->ibuf),
+	    ssl->obuf, sizeof(ssl->obuf));
+
+	/* send SNI when we were given a name */
+	if (!br_ssl_client_reset(&ssl->sc,
+	    remote_hostname[0] ? remote_hostname : NULL, 0)) {
+		syslog.logf(LOG_ERR, "[%d] TLS setup failed (%d)", slot,
+		    br_ssl_engine_last_error(eng));
+		return false;
+	}
+
+	return true;
+}
+
+void
+SocksClient::tls_free()
+{
+	if (ssl == NULL)
+		return;
+
+	free(ssl);
+	ssl = NULL;
+	stack_thunk_del_ref();
+}
+
+/*
+ * Move TLS records between the engine and the remote connection, as much
+ * as can be done without waiting.  Returns false once the engine closes.
+ */
+bool
+SocksClient::tls_pump()
+{
+	br_ssl_engine_context *eng = &ssl->sc.eng;
+	unsigned char *buf;
+	size_t len, room;
+	unsigned st;
+	int ret;
+
+	for (;;) {
+		st = br_ssl_engine_current_state(eng);
+		if (st & BR_SSL_CLOSED)
+			return false;
+
+		if (st & BR_SSL_SENDREC) {
+			room = remote_client.availableForWrite();
+			buf = br_ssl_engine_sendrec_buf(eng, &len);
+			if (len > room)
+				len = room;
+			if (len && (ret = remote_client.write(buf, len)) > 0) {
+				br_ssl_engine_sendrec_ack(eng, ret);
+				continue;
+			}
+		}
+
+		if ((st & BR_SSL_RECVREC) && remote_client.available()) {
+			buf = br_ssl_engine_recvrec_buf(eng, &len);
+			ret = remote_client.read(buf, len);
+			if (ret > 0) {
+				br_ssl_engine_recvrec_ack(eng, ret);
+				continue;
+			}
+		}
+
+		return true;
+	}
+}
+
+/* read plain or decrypted data from the remote server, if there is any */
+int
+SocksClient::remote_read(unsigned char *buf, size_t len)
+{
+	br_ssl_engine_context *eng;
+	unsigned char *rbuf;
+	size_t rlen;
+
+	if (!tls()) {
+		if (!remote_client.available())
+			return 0;
+		return remote_client.read(buf, len);
+	}
+
+	eng = &ssl->sc.eng;
+	if (!tls_pump() || !(br_ssl_engine_current_state(eng) & BR_SSL_RECVAPP))
+		return 0;
+
+	rbuf = br_ssl_engine_recvapp_buf(eng, &rlen);
+	if (rlen > len)
+		rlen = len;
+	memcpy(buf, rbuf, rlen);
+	br_ssl_engine_recvapp_ack(eng, rlen);
+
+	return rlen;
+}
+
+/* write to the remote server, as much as it can take without blocking */
+int
+SocksClient::remote_write(const unsigned char *buf, size_t len)
+{
+	br_ssl_engine_context *eng;
+	unsigned char *wbuf;
+	size_t wlen;
+
+	if (!tls()) {
+		wlen = remote_client.availableForWrite();
+		if (len > wlen)
+			len = wlen;
+		if (len == 0)
+			return 0;
+		return remote_client.write(buf, len);
+	}
+
+	eng = &ssl->sc.eng;
+	if (!tls_pump() || !(br_ssl_engine_current_state(eng) & BR_SSL_SENDAPP))
+		return 0;
+
+	wbuf = br_ssl_engine_sendapp_buf(eng, &wlen);
+	if (wlen > len)
+		wlen = len;
+	memcpy(wbuf, buf, wlen);
+	br_ssl_engine_sendapp_ack(eng, wlen);
+	br_ssl_engine_flush(eng, 0);
+	tls_pump();
+
+	return wlen;
+}
+
+/* whether the remote server may still send us something */
+bool
+SocksClient::remote_open()
+{
+	unsigned st;
+
+	if (!tls())
+		return remote_client.connected();
+
+	st = br_ssl_engine_current_state(&ssl->sc.eng);
+	if (st & BR_SSL_RECVAPP)
+		return true;
+	if (st & BR_SSL_CLOSED)
+		return false;
+	return remote_client.connected();
+}
+
+/*
+ * Size the proxy buffers for this session from what's left after the
+ * connection (and any TLS state) has been set up.
+ */
+bool
+SocksClient::alloc_rings()
+{
+	size_t lsize, rsize, budget;
+
+	lsize = tls() ? PROXY_BUF_LOCAL_TLS : PROXY_BUF_LOCAL;
+	rsize = tls() ? PROXY_BUF_REMOTE_TLS : PROXY_BUF_REMOTE;
+
+	budget = ESP.getFreeHeap() / PROXY_BUF_HEAP_DIVISOR;
+	if (lsize + rsize > budget) {
+		lsize = (lsize * budget) / (lsize + rsize);
+		rsize = budget - lsize;
+	}
+	if (lsize < PROXY_BUF_MIN)
+		lsize = PROXY_BUF_MIN;
+	if (rsize < PROXY_BUF_MIN)
+		rsize = PROXY_BUF_MIN;
+
+	if (!ring_alloc(&local_ring, lsize) ||
+	    !ring_alloc(&remote_ring, rsize)) {
+		syslog.logf(LOG_ERR, "[%d] malloc(%d+%d) failure", slot,
+		    lsize, rsize);
+		ring_free(&local_ring);
+		ring_free(&remote_ring);
+		return false;
+	}
+
+#ifdef SOCKS_TRACE
+	syslog.logf(LOG_DEBUG, "[%d] proxy buffers local:%d remote:%d "
+	    "free:%d", slot, lsize, rsize, ESP.getFreeHeap());
+#endif
+
+	return true;
+}
+
 void
 SocksClient::proxy()
 {
-	size_t len, wrote;
+	unsigned char *ptr;
+	size_t len, room;
+	int ret;
 
 	if (!verify_state(STATE_PROXY))
 		return;
 
+	/* send out any records BearSSL has waiting */
+	if (tls())
+		tls_pump();
+
 	/*
 	 * Process buffers before checking connection, we may have read some
 	 * before the client closed.
 	 */
 
-	/* push out buffered data from remote to local client */
-	if (remote_buf_len) {
-		len = remote_buf_len;
-		if (len > 64)
-			len = 64;
-		wrote = local_client.write(remote_buf, len);
-		if (wrote) {
-			memmove(remote_buf, remote_buf + wrote,
-			    remote_buf_len - wrote);
-			remote_buf_len -= wrote;
+	/*
+	 * Push out buffered data from remote to local client, only as much as
+	 * it can take without blocking.  The second pass picks up the rest
+	 * of the data if it wrapped around the end of the ring.
+	 */
+	while (remote_ring.len) {
+		room = local_client.availableForWrite();
+		if (room == 0)
+			break;
+		len = ring_out(&remote_ring, &ptr);
+		if (len > room)
+			len = room;
+		ret = local_client.write(ptr, len);
+		if (ret <= 0)
+			break;
+		ring_consume(&remote_ring, ret);
 #ifdef SOCKS_TRACE
-			syslog.logf(LOG_DEBUG, "[%d] wrote %d to local "
-			    "(%d left)", slot, wrote, remote_buf_len);
+		syslog.logf(LOG_DEBUG, "[%d] wrote %d to local (%d left)",
+		    slot, ret, remote_ring.len);
 #endif
-		}
+		if ((size_t)ret < len)
+			break;
 	}
 
-	/* push out buffered data from local to remote client */
-	if (local_buf_len) {
-		wrote = REMOTE_CLIENT.write(local_buf, local_buf_len);
-		if (wrote) {
-			memmove(local_buf, local_buf + wrote,
-			    local_buf_len - wrote);
-			local_buf_len -= wrote;
+	/*
+	 * Push out buffered data from local to remote client, which for TLS
+	 * goes one record at a time.
+	 */
+	while (local_ring.len) {
+		len = ring_out(&local_ring, &ptr);
+		ret = remote_write(ptr, len);
+		if (ret <= 0)
+			break;
+		ring_consume(&local_ring, ret);
 #ifdef SOCKS_TRACE
-			syslog.logf(LOG_DEBUG, "[%d] wrote %d to remote "
-			    "(%d left)", slot, wrote, local_buf_len);
+		syslog.logf(LOG_DEBUG, "[%d] wrote %d to remote (%d left)",
+		    slot, ret, local_ring.len);
 #endif
-		}
 	}
 
 	/* buffer new data from local client */
-	if (local_client.available() && local_buf_len < sizeof(local_buf)) {
-		len = local_client.read(local_buf + local_buf_len,
-		    sizeof(local_buf) - local_buf_len);
+	while (local_ring.len < local_ring.size && local_client.available()) {
+		len = ring_in(&local_ring, &ptr);
+		ret = local_client.read(ptr, len);
+		if (ret <= 0)
+			break;
 #ifdef SOCKS_TRACE
 		syslog.logf(LOG_DEBUG, "[%d] read %d from local (now %d):",
-		    slot, len, local_buf_len + len);
-		syslog_buf((const char *)local_buf + local_buf_len, len);
+		    slot, ret, local_ring.len + ret);
+		syslog_buf((const char *)ptr, ret);
 #endif
-		local_buf_len += len;
+		local_ring.len += ret;
+		if ((size_t)ret < len)
+			break;
 	}
 
 	/* and then read in new data from remote if we have room */
-	if (REMOTE_CLIENT.available() &&
-	    (remote_buf_len < sizeof(remote_buf))) {
-		len = REMOTE_CLIENT.read(remote_buf + remote_buf_len,
-		    sizeof(remote_buf) - remote_buf_len);
+	while (remote_ring.len < remote_ring.size) {
+		len = ring_in(&remote_ring, &ptr);
+		ret = remote_read(ptr, len);
+		if (ret <= 0)
+			break;
 #ifdef SOCKS_TRACE
 		syslog.logf(LOG_DEBUG, "[%d] read %d from remote (now %d):",
-		    slot, len, remote_buf_len + len);
-		syslog_buf((const char *)remote_buf + remote_buf_len, len);
+		    slot, ret, remote_ring.len + ret);
+		syslog_buf((const char *)ptr, ret);
 #endif
-		remote_buf_len += len;
+		remote_ring.len += ret;
 	}
 
 #ifdef SOCKS_TRACE
 	if (millis() - last_buffer_check > (3 * 1000)) {
-		syslog.logf(LOG_DEBUG, "[%d] local:%d remote:%d free:%d", slot,
-		    local_buf_len, remote_buf_len, ESP.getFreeHeap());
+		syslog.logf(LOG_DEBUG, "[%d] local:%d/%d remote:%d/%d free:%d",
+		    slot, local_ring.len, local_ring.size, remote_ring.len,
+		    remote_ring.size, ESP.getFreeHeap());
 		last_buffer_check = millis();
 	}
 #endif
-
 	if (!local_client.connected()) {
 #ifdef SOCKS_TRACE
 		syslog.logf(LOG_DEBUG, "[%d] local client closed", slot);
 #endif
-		REMOTE_CLIENT.stop();
+		remote_client.stop();
 		finish();
 		return;
 	}
 
-	if (!REMOTE_CLIENT.connected()) {
+	/* pass along everything the remote sent before it closed */
+	if (!remote_open() && remote_ring.len == 0) {
 #ifdef SOCKS_TRACE
 		syslog.logf(LOG_DEBUG, "[%d] remote client closed", slot);
 #endif
 		local_client.stop();
-		REMOTE_CLIENT.stop();
+		remote_client.stop();
 		finish();
 		return;
 	}
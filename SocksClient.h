@@ -18,44 +18,88 @@
 #pragma once
 
 #include <WiFiClient.h>
-#include <WiFiClientSecure.h>
+#include <lwip/err.h>
+#include <lwip/ip_addr.h>
+
+struct tcp_pcb;
+struct socks_tls;
+
+/* longest hostname a request can carry, its length is a single byte */
+#define SOCKS_HOSTNAME_MAX	255
+
+/* ring buffer for proxied data in one direction */
+struct socks_ring {
+	unsigned char *data;
+	size_t size;
+	size_t off;	/* start of buffered data */
+	size_t len;	/* bytes buffered */
+};
 
 class SocksClient : public WiFiClient {
 public:
 	virtual ~SocksClient();
-	SocksClient(int _slot, WiFiClient _client);
+	SocksClient();
 
+	void begin(int _slot, WiFiClient _client);
 	bool done();
 	void process();
+	void reset();
 
 	bool tls() { return _tls; };
 	int state;
 	int slot;
 	WiFiClient local_client;
 	WiFiClient remote_client;
-	WiFiClientSecure remote_client_tls;
 
 private:
 	void verify_method();
 	bool verify_state(int _state);
 	bool verify_version();
 	void handle_request();
+	void resolve();
+	static void dns_found(const char *name, const ip_addr_t *ipaddr,
+	    void *arg);
 	void fail_close(char code);
 	void connect();
+	void connecting();
+	static err_t connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err);
+	static void connect_err_cb(void *arg, err_t err);
+	void handshake();
+	void established();
 	void proxy();
 	void finish();
+	bool alloc_rings();
+
+	bool tls_start();
+	bool tls_pump();
+	void tls_free();
+	int remote_read(unsigned char *buf, size_t len);
+	int remote_write(const unsigned char *buf, size_t len);
+	bool remote_open();
 
 	void dump_buf(char *buf, size_t len);
 
-	/* data from local client */
-	unsigned char local_buf[32];
+	/* SOCKS method and request from local client */
+	unsigned char local_buf[5 + SOCKS_HOSTNAME_MAX + 2];
 	size_t local_buf_len;
 
-	/* data from remote client */
-	unsigned char remote_buf[256];
-	size_t remote_buf_len;
-	unsigned char *remote_hostname;
+	/* proxied data from local client, and from remote client */
+	struct socks_ring local_ring;
+	struct socks_ring remote_ring;
+	char remote_hostname[SOCKS_HOSTNAME_MAX + 1];
+	unsigned long resolve_start;
+	bool resolved;
 	ip4_addr_t remote_ip;
 	uint16_t remote_port;
+
+	/* our own pcb until lwIP says it's connected, and how that went */
+	struct tcp_pcb *pcb;
+	err_t connect_err;
+	unsigned long connect_start;
+	unsigned long connect_ms;
+	unsigned long handshake_start;
+	unsigned long handshake_ms;
+
 	bool _tls;
+	struct socks_tls *ssl;
 };
@@ -0,0 +1,1028 @@
+/*
+ * WiFiPPP
+ * Copyright (c) 2021 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * PPP Compression Control Protocol (RFC 1962) with Deflate (RFC 1979).
+ *
+ * lwIP's PPP only knows MPPE, so hdlc.cpp hands CCP packets and compressed
+ * datagrams to us instead of to lwIP.  Both directions use a 512-byte
+ * window, the smallest Deflate allows, so this costs a few KB of heap
+ * while the link is up rather than the 32KB and up zlib would want.
+ * Outbound packets are matched against the window through a single-probe
+ * hash table and coded with the fixed Huffman codes; inbound ones are
+ * inflated with a small canonical code decoder that handles any block
+ * type.
+ *
+ * Each packet is a sync point in one continuous stream, the way pppd's
+ * kernel side does it: it ends with a bare stored block header padded to
+ * a byte.  Packets that don't get smaller are sent as they are, but still
+ * go into the history, since the peer adds every uncompressed datagram to
+ * its own.
+ */
+
+#include <lwip/pbuf.h>
+#include <netif/ppp/ppp_impl.h>
+
+#include "wifippp.h"
+
+/* CCP codes, from RFC 1962 */
+#define CCP_CONFREQ		1
+#define CCP_CONFACK		2
+#define CCP_CONFNAK		3
+#define CCP_CONFREJ		4
+#define CCP_TERMREQ		5
+#define CCP_TERMACK		6
+#define CCP_RESETREQ		14
+#define CCP_RESETACK		15
+
+/* the Deflate option: window size and method, then check method */
+#define CCP_OPT_DEFLATE		26
+#define CCP_DEFLATE_LEN		4
+#define CCP_DEFLATE_METHOD	8
+#define CCP_DEFLATE_CHK_SEQ	0
+#define CCP_DEFLATE_MIN_BITS	9
+#define CCP_DEFLATE_MAX_BITS	15
+
+#define CCP_WINDOW_BITS		9
+#define CCP_WINDOW		(1 << CCP_WINDOW_BITS)
+
+/* longest option list we'll echo back in an Ack or Reject */
+#define CCP_MAX_OPTS		64
+
+#define CCP_RESTART_MS		3000
+#define CCP_MAX_CONFREQS	10
+
+/* a protocol field and the largest datagram behind it */
+#define CCP_MAX_DATA		(2 + PPP_MRU)
+
+#define CCP_HASH_BITS		9
+#define CCP_MIN_MATCH		3
+#define CCP_MAX_MATCH		258
+
+/* end of block, and where length codes start */
+#define CCP_EOB			256
+
+struct ccp_tx {
+	uint16_t seq;
+	size_t hist;		/* bytes of history at the start of buf */
+	size_t len;		/* bytes of the packet after it, not yet sent */
+	uint16_t hash[1 << CCP_HASH_BITS];	/* position + 1, 0 if none */
+	uint8_t buf[CCP_WINDOW + CCP_MAX_DATA];
+};
+
+struct ccp_huff {
+	uint16_t *counts;
+	uint16_t *symbols;
+};
+
+struct ccp_rx {
+	uint16_t seq;
+	uint16_t whead;		/* where the next history byte goes in win */
+	uint16_t wlen;		/* bytes of history in win */
+	uint8_t win[CCP_WINDOW];
+	uint16_t lcounts[16];
+	uint16_t lsymbols[288];
+	uint16_t dcounts[16];
+	uint16_t dsymbols[30];
+	struct ccp_huff lit;
+	struct ccp_huff dist;
+	uint8_t out[CCP_MAX_DATA];
+};
+
+/* bits going out, least significant first */
+struct ccp_bitbuf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	uint32_t bits;
+	int nbits;
+	bool overflow;
+};
+
+/* bits coming in */
+struct ccp_bitsrc {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+	uint32_t bits;
+	int nbits;
+};
+
+static const uint16_t ccp_len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,
+	59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t ccp_len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,
+	4, 5, 5, 5, 5, 0,
+};
+static const uint16_t ccp_dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+	513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385,
+	24577,
+};
+static const uint8_t ccp_dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
+	10, 11, 11, 12, 12, 13, 13,
+};
+/* the order code length code lengths are sent in */
+static const uint8_t ccp_clen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+struct ccp_stats ccp_stats = { 0 };
+
+static struct {
+	bool enabled;		/* AT$CCP, latched when the link comes up */
+	bool started;		/* we've sent a Configure-Request */
+	bool ack_rcvd;
+	bool ack_sent;
+	bool opened;
+	bool want_deflate;	/* our request asks the peer to compress */
+	bool peer_deflate;	/* we agreed to compress for the peer */
+	uint8_t id;
+	uint8_t reqs;
+	unsigned long req_sent;
+	bool reset_pending;
+	uint8_t reset_id;
+	unsigned long reset_sent;
+} ccp;
+
+static struct ccp_tx *ccp_tx = NULL;
+static struct ccp_rx *ccp_rx = NULL;
+
+static void
+ccp_send(uint8_t code, uint8_t id, const uint8_t *data, size_t len)
+{
+	uint8_t pkt[4 + CCP_MAX_OPTS];
+
+	if (len > CCP_MAX_OPTS)
+		return;
+
+	pkt[0] = code;
+	pkt[1] = id;
+	pkt[2] = (4 + len) >> 8;
+	pkt[3] = (4 + len) & 0xff;
+	if (len)
+		memcpy(pkt + 4, data, len);
+
+	hdlc_control(PPP_CCP, pkt, 4 + len);
+}
+
+static void
+ccp_tx_reset(void)
+{
+	if (ccp_tx == NULL)
+		return;
+
+	ccp_tx->seq = 0;
+	ccp_tx->hist = 0;
+	ccp_tx->len = 0;
+	memset(ccp_tx->hash, 0, sizeof(ccp_tx->hash));
+}
+
+static void
+ccp_rx_reset(void)
+{
+	if (ccp_rx == NULL)
+		return;
+
+	ccp_rx->seq = 0;
+	ccp_rx->whead = 0;
+	ccp_rx->wlen = 0;
+	ccp.reset_pending = false;
+}
+
+/* forget everything, as when the link goes down */
+void
+ccp_reset(void)
+{
+	free(ccp_tx);
+	ccp_tx = NULL;
+	free(ccp_rx);
+	ccp_rx = NULL;
+
+	memset(&ccp, 0, sizeof(ccp));
+	ccp.enabled = (settings->ppp_ccp != 0);
+	ccp.want_deflate = true;
+}
+
+bool
+ccp_tx_running(void)
+{
+	return (ccp.opened && ccp.peer_deflate && ccp_tx != NULL);
+}
+
+static bool
+ccp_rx_running(void)
+{
+	return (ccp.opened && ccp.want_deflate && ccp_rx != NULL);
+}
+
+const char *
+ccp_state(void)
+{
+	if (!ccp.enabled)
+		return "off";
+	if (!ccp.opened)
+		return "not negotiated";
+	if (ccp_tx_running() && ccp_rx_running())
+		return "Deflate both ways";
+	if (ccp_tx_running())
+		return "Deflate out only";
+	if (ccp_rx_running())
+		return "Deflate in only";
+	return "no compression agreed";
+}
+
+static void
+ccp_send_confreq(void)
+{
+	uint8_t opt[CCP_DEFLATE_LEN];
+
+	if (ccp.want_deflate && ccp_rx == NULL) {
+		ccp_rx = (struct ccp_rx *)malloc(sizeof(struct ccp_rx));
+		if (ccp_rx == NULL) {
+			syslog.logf(LOG_WARNING, "CCP: no memory to inflate, "
+			    "free mem %d", ESP.getFreeHeap());
+			ccp.want_deflate = false;
+		} else {
+			ccp_rx->lit.counts = ccp_rx->lcounts;
+			ccp_rx->lit.symbols = ccp_rx->lsymbols;
+			ccp_rx->dist.counts = ccp_rx->dcounts;
+			ccp_rx->dist.symbols = ccp_rx->dsymbols;
+		}
+	}
+
+	ccp.started = true;
+	ccp.ack_rcvd = false;
+	ccp.id++;
+	ccp.reqs++;
+	ccp.req_sent = millis();
+
+	if (ccp.want_deflate) {
+		opt[0] = CCP_OPT_DEFLATE;
+		opt[1] = CCP_DEFLATE_LEN;
+		opt[2] = ((CCP_WINDOW_BITS - 8) << 4) | CCP_DEFLATE_METHOD;
+		opt[3] = CCP_DEFLATE_CHK_SEQ;
+		ccp_send(CCP_CONFREQ, ccp.id, opt, sizeof(opt));
+	} else
+		ccp_send(CCP_CONFREQ, ccp.id, NULL, 0);
+}
+
+static void
+ccp_send_resetreq(void)
+{
+	if (!ccp.reset_pending) {
+		ccp.reset_pending = true;
+		ccp.reset_id = ++ccp.id;
+		ccp_stats.rx_resets++;
+	}
+	ccp.reset_sent = millis();
+	ccp_send(CCP_RESETREQ, ccp.reset_id, NULL, 0);
+}
+
+static void
+ccp_up(void)
+{
+	if (ccp.opened || !ccp.ack_rcvd || !ccp.ack_sent)
+		return;
+
+	ccp.opened = true;
+	ccp_tx_reset();
+	ccp_rx_reset();
+
+	syslog.logf(LOG_INFO, "CCP up: %s", ccp_state());
+}
+
+static void
+ccp_down(void)
+{
+	bool enabled = ccp.enabled;
+
+	if (ccp.opened)
+		syslog.log(LOG_INFO, "CCP down");
+
+	ccp_reset();
+	ccp.enabled = enabled;
+}
+
+/*
+ * Take the peer's Deflate option as long as it's one we can compress for,
+ * which is any window size since ours is the smallest; anything else is
+ * rejected.
+ */
+static void
+ccp_rcv_confreq(uint8_t id, const uint8_t *opts, size_t len)
+{
+	uint8_t rej[CCP_MAX_OPTS], nak[CCP_DEFLATE_LEN];
+	size_t i, olen, rlen = 0, nlen = 0;
+	bool deflate = false;
+	int bits;
+
+	if (len > CCP_MAX_OPTS)
+		return;
+
+	for (i = 0; i < len; i += olen) {
+		if (len - i < 2 || (olen = opts[i + 1]) < 2 || olen > len - i)
+			return;
+
+		if (opts[i] != CCP_OPT_DEFLATE || olen != CCP_DEFLATE_LEN ||
+		    deflate) {
+			memcpy(rej + rlen, opts + i, olen);
+			rlen += olen;
+			continue;
+		}
+
+		deflate = true;
+		bits = (opts[i + 2] >> 4) + 8;
+		if ((opts[i + 2] & 0x0f) != CCP_DEFLATE_METHOD ||
+		    opts[i + 3] != CCP_DEFLATE_CHK_SEQ ||
+		    bits < CCP_DEFLATE_MIN_BITS ||
+		    bits > CCP_DEFLATE_MAX_BITS) {
+			if (bits < CCP_DEFLATE_MIN_BITS)
+				bits = CCP_DEFLATE_MIN_BITS;
+			if (bits > CCP_DEFLATE_MAX_BITS)
+				bits = CCP_DEFLATE_MAX_BITS;
+			nak[0] = CCP_OPT_DEFLATE;
+			nak[1] = CCP_DEFLATE_LEN;
+			nak[2] = ((bits - 8) << 4) | CCP_DEFLATE_METHOD;
+			nak[3] = CCP_DEFLATE_CHK_SEQ;
+			nlen = sizeof(nak);
+		}
+	}
+
+	if (deflate && rlen == 0 && nlen == 0 && ccp_tx == NULL) {
+		ccp_tx = (struct ccp_tx *)malloc(sizeof(struct ccp_tx));
+		if (ccp_tx == NULL) {
+			syslog.logf(LOG_WARNING, "CCP: no memory to deflate, "
+			    "free mem %d", ESP.getFreeHeap());
+			memcpy(rej, opts, len);
+			rlen = len;
+		}
+	}
+
+	/* a new request on an open link starts negotiation over */
+	if (ccp.opened) {
+		ccp.opened = false;
+		ccp_send_confreq();
+	} else if (!ccp.started)
+		ccp_send_confreq();
+
+	if (rlen) {
+		ccp.ack_sent = false;
+		ccp_send(CCP_CONFREJ, id, rej, rlen);
+	} else if (nlen) {
+		ccp.ack_sent = false;
+		ccp_send(CCP_CONFNAK, id, nak, nlen);
+	} else {
+		ccp.ack_sent = true;
+		ccp.peer_deflate = deflate;
+		ccp_send(CCP_CONFACK, id, opts, len);
+		ccp_up();
+	}
+}
+
+/*
+ * A CCP packet from the peer, after its protocol field.  Returns false if
+ * CCP is off, to let lwIP reject it.
+ */
+bool
+ccp_input(const uint8_t *pkt, size_t len)
+{
+	uint8_t code, id;
+	size_t plen;
+
+	if (!ccp.enabled)
+		return false;
+	if (len < 4)
+		return true;
+
+	code = pkt[0];
+	id = pkt[1];
+	plen = (pkt[2] << 8) | pkt[3];
+	if (plen < 4 || plen > len)
+		return true;
+	pkt += 4;
+	plen -= 4;
+
+	switch (code) {
+	case CCP_CONFREQ:
+		ccp_rcv_confreq(id, pkt, plen);
+		break;
+	case CCP_CONFACK:
+		if (!ccp.started || ccp.ack_rcvd || id != ccp.id)
+			break;
+		ccp.ack_rcvd = true;
+		ccp.reqs = 0;
+		ccp_up();
+		break;
+	case CCP_CONFNAK:
+	case CCP_CONFREJ:
+		if (!ccp.started || ccp.ack_rcvd || id != ccp.id)
+			break;
+		/*
+		 * The only thing we ask for is Deflate with our window, so
+		 * if that's not acceptable, settle for receiving as is.
+		 */
+		ccp.want_deflate = false;
+		ccp.reqs = 0;
+		ccp_send_confreq();
+		break;
+	case CCP_TERMREQ:
+		ccp_send(CCP_TERMACK, id, NULL, 0);
+		ccp_down();
+		break;
+	case CCP_RESETREQ:
+		/* the peer lost track, start our history over */
+		if (ccp_tx_running()) {
+			ccp_tx_reset();
+			ccp_stats.tx_resets++;
+		}
+		ccp_send(CCP_RESETACK, id, NULL, 0);
+		break;
+	case CCP_RESETACK:
+		if (ccp.reset_pending && id == ccp.reset_id)
+			ccp_rx_reset();
+		break;
+	}
+
+	return true;
+}
+
+/* resend whatever hasn't been answered */
+void
+ccp_process(void)
+{
+	unsigned long now = millis();
+
+	if (!ccp.enabled)
+		return;
+
+	if (ccp.started && !ccp.ack_rcvd &&
+	    now - ccp.req_sent >= CCP_RESTART_MS) {
+		if (ccp.reqs >= CCP_MAX_CONFREQS) {
+			syslog.log(LOG_WARNING, "CCP: no answer from peer, "
+			    "giving up");
+			ccp.started = false;
+			ccp.enabled = false;
+			return;
+		}
+		ccp_send_confreq();
+	}
+
+	if (ccp.reset_pending && now - ccp.reset_sent >= CCP_RESTART_MS)
+		ccp_send_resetreq();
+}
+
+static void
+ccp_putbits(struct ccp_bitbuf *b, uint32_t v, int n)
+{
+	b->bits |= v << b->nbits;
+	b->nbits += n;
+
+	while (b->nbits >= 8) {
+		if (b->len == b->size)
+			b->overflow = true;
+		else
+			b->data[b->len++] = b->bits & 0xff;
+		b->bits >>= 8;
+		b->nbits -= 8;
+	}
+}
+
+/* Huffman codes go out most significant bit first */
+static void
+ccp_putcode(struct ccp_bitbuf *b, uint32_t code, int n)
+{
+	uint32_t rev = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		rev = (rev << 1) | (code & 1);
+		code >>= 1;
+	}
+
+	ccp_putbits(b, rev, n);
+}
+
+/* a literal/length symbol in the fixed code from RFC 1951 3.2.6 */
+static void
+ccp_putlit(struct ccp_bitbuf *b, int sym)
+{
+	if (sym < 144)
+		ccp_putcode(b, 0x30 + sym, 8);
+	else if (sym < 256)
+		ccp_putcode(b, 0x190 + sym - 144, 9);
+	else if (sym < 280)
+		ccp_putcode(b, sym - 256, 7);
+	else
+		ccp_putcode(b, 0xc0 + sym - 280, 8);
+}
+
+static void
+ccp_putmatch(struct ccp_bitbuf *b, size_t len, size_t dist)
+{
+	int i;
+
+	for (i = 28; ccp_len_base[i] > len; i--)
+		;
+	ccp_putlit(b, CCP_EOB + 1 + i);
+	ccp_putbits(b, len - ccp_len_base[i], ccp_len_extra[i]);
+
+	for (i = 29; ccp_dist_base[i] > dist; i--)
+		;
+	ccp_putcode(b, i, 5);
+	ccp_putbits(b, dist - ccp_dist_base[i], ccp_dist_extra[i]);
+}
+
+static unsigned int
+ccp_hash(const uint8_t *p)
+{
+	uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+
+	return (uint32_t)(v * 2654435761UL) >> (32 - CCP_HASH_BITS);
+}
+
+/*
+ * Code tx->len bytes at tx->buf + tx->hist as one fixed Huffman block,
+ * followed by a bare stored block header to end the packet on a byte.
+ * Returns the number of bytes written to out, or 0 if they didn't fit.
+ *
+ * Hash entries may point at bytes from a packet that was coded but never
+ * sent, so candidates are only used from before the current position and
+ * are always checked against what's really there.
+ */
+static size_t
+ccp_deflate(struct ccp_tx *tx, uint8_t *out, size_t size)
+{
+	struct ccp_bitbuf b = { out, 0, size, 0, 0, false };
+	const uint8_t *buf = tx->buf;
+	size_t i, end, cand, mlen, max, j;
+	unsigned int h;
+
+	/* not final, fixed codes */
+	ccp_putbits(&b, 1 << 1, 3);
+
+	i = tx->hist;
+	end = tx->hist + tx->len;
+	while (i < end && !b.overflow) {
+		mlen = 0;
+		cand = 0;
+		if (end - i >= CCP_MIN_MATCH) {
+			h = ccp_hash(buf + i);
+			cand = tx->hash[h];
+			tx->hash[h] = i + 1;
+			if (cand && cand - 1 < i &&
+			    i - (cand - 1) <= CCP_WINDOW) {
+				cand--;
+				max = end - i;
+				if (max > CCP_MAX_MATCH)
+					max = CCP_MAX_MATCH;
+				while (mlen < max && buf[cand + mlen] ==
+				    buf[i + mlen])
+					mlen++;
+			}
+		}
+
+		if (mlen < CCP_MIN_MATCH) {
+			ccp_putlit(&b, buf[i]);
+			i++;
+			continue;
+		}
+
+		ccp_putmatch(&b, mlen, i - cand);
+
+		/* so later data can match anywhere in this run too */
+		for (j = i + 1; j < i + mlen && end - j >= CCP_MIN_MATCH; j++)
+			tx->hash[ccp_hash(buf + j)] = j + 1;
+		i += mlen;
+	}
+
+	ccp_putlit(&b, CCP_EOB);
+	ccp_putbits(&b, 0, 3);
+	if (b.nbits)
+		ccp_putbits(&b, 0, 8 - b.nbits);
+
+	return (b.overflow ? 0 : b.len);
+}
+
+/*
+ * Compress a network datagram for the peer, returning a new pbuf with the
+ * sequence number and compressed data, or NULL to send it as it is.
+ * Either way, it only goes into our history once ccp_commit() says it
+ * actually went out.
+ */
+struct pbuf *
+ccp_compress(uint16_t protocol, struct pbuf *p)
+{
+	struct ccp_tx *tx = ccp_tx;
+	struct pbuf *cp;
+	uint8_t *d;
+	size_t n = 0, clen;
+
+	if (!ccp_tx_running())
+		return NULL;
+
+	/* LCP never lets the MTU past our MRU, but don't trust it */
+	if (2 + p->tot_len > CCP_MAX_DATA) {
+		tx->len = 0;
+		return NULL;
+	}
+
+	d = tx->buf + tx->hist;
+	if (protocol > 0xff)
+		d[n++] = protocol >> 8;
+	d[n++] = protocol & 0xff;
+	pbuf_copy_partial(p, d + n, p->tot_len, 0);
+	tx->len = n + p->tot_len;
+
+	/* only worth sending compressed if it comes out smaller */
+	if (tx->len <= 3)
+		return NULL;
+	cp = pbuf_alloc(PBUF_RAW, tx->len - 1, PBUF_RAM);
+	if (cp == NULL)
+		return NULL;
+
+	d = (uint8_t *)cp->payload;
+	d[0] = tx->seq >> 8;
+	d[1] = tx->seq & 0xff;
+	clen = ccp_deflate(tx, d + 2, tx->len - 3);
+	if (clen == 0) {
+		pbuf_free(cp);
+		return NULL;
+	}
+	pbuf_realloc(cp, 2 + clen);
+
+	return cp;
+}
+
+/*
+ * The datagram last given to ccp_compress() went out, as cp if that was
+ * compressed or as it was if cp is NULL.
+ */
+void
+ccp_commit(struct pbuf *cp)
+{
+	struct ccp_tx *tx = ccp_tx;
+	size_t total, shift;
+	unsigned int i;
+
+	if (!ccp_tx_running() || tx->len == 0)
+		return;
+
+	ccp_stats.tx_bytes += tx->len;
+	ccp_stats.tx_wire += (cp ? cp->tot_len : tx->len);
+
+	total = tx->hist + tx->len;
+	shift = (total > CCP_WINDOW ? total - CCP_WINDOW : 0);
+	if (shift) {
+		memmove(tx->buf, tx->buf + shift, total - shift);
+		for (i = 0; i < (1 << CCP_HASH_BITS); i++)
+			tx->hash[i] = (tx->hash[i] > shift ?
+			    tx->hash[i] - shift : 0);
+	}
+
+	tx->hist = total - shift;
+	tx->len = 0;
+	tx->seq++;
+}
+
+static int
+ccp_getbits(struct ccp_bitsrc *s, int n)
+{
+	int v;
+
+	while (s->nbits < n) {
+		if (s->pos == s->len)
+			return -1;
+		s->bits |= (uint32_t)s->data[s->pos++] << s->nbits;
+		s->nbits += 8;
+	}
+
+	v = s->bits & ((1UL << n) - 1);
+	s->bits >>= n;
+	s->nbits -= n;
+
+	return v;
+}
+
+/* decode one symbol a bit at a time, the way zlib's puff does */
+static int
+ccp_decode(struct ccp_bitsrc *s, const struct ccp_huff *h)
+{
+	int code = 0, first = 0, index = 0, len, count, b;
+
+	for (len = 1; len < 16; len++) {
+		if ((b = ccp_getbits(s, 1)) < 0)
+			return -1;
+		code |= b;
+		count = h->counts[len];
+		if (code - first < count)
+			return h->symbols[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+
+	return -1;
+}
+
+static bool
+ccp_huff_build(struct ccp_huff *h, const uint8_t *lengths, int n)
+{
+	uint16_t offs[16];
+	int i, left;
+
+	memset(h->counts, 0, 16 * sizeof(h->counts[0]));
+	for (i = 0; i < n; i++)
+		h->counts[lengths[i]]++;
+	h->counts[0] = 0;
+
+	/* incomplete codes are fine, oversubscribed ones aren't */
+	left = 1;
+	for (i = 1; i < 16; i++) {
+		left <<= 1;
+		left -= h->counts[i];
+		if (left < 0)
+			return false;
+	}
+
+	offs[1] = 0;
+	for (i = 1; i < 15; i++)
+		offs[i + 1] = offs[i] + h->counts[i];
+	for (i = 0; i < n; i++)
+		if (lengths[i])
+			h->symbols[offs[lengths[i]]++] = i;
+
+	return true;
+}
+
+static void
+ccp_fixed(struct ccp_rx *rx)
+{
+	uint8_t lengths[288];
+	int i;
+
+	for (i = 0; i < 144; i++)
+		lengths[i] = 8;
+	for (; i < 256; i++)
+		lengths[i] = 9;
+	for (; i < 280; i++)
+		lengths[i] = 7;
+	for (; i < 288; i++)
+		lengths[i] = 8;
+	ccp_huff_build(&rx->lit, lengths, 288);
+
+	for (i = 0; i < 30; i++)
+		lengths[i] = 5;
+	ccp_huff_build(&rx->dist, lengths, 30);
+}
+
+static bool
+ccp_dynamic(struct ccp_rx *rx, struct ccp_bitsrc *s)
+{
+	uint8_t lengths[286 + 30];
+	int nlen, ndist, ncode, i, sym, rep, v;
+
+	if ((nlen = ccp_getbits(s, 5)) < 0 ||
+	    (ndist = ccp_getbits(s, 5)) < 0 ||
+	    (ncode = ccp_getbits(s, 4)) < 0)
+		return false;
+	nlen += 257;
+	ndist += 1;
+	ncode += 4;
+	if (nlen > 286 || ndist > 30)
+		return false;
+
+	/* the code length code, borrowing the distance table */
+	memset(lengths, 0, 19);
+	for (i = 0; i < ncode; i++) {
+		if ((v = ccp_getbits(s, 3)) < 0)
+			return false;
+		lengths[ccp_clen_order[i]] = v;
+	}
+	if (!ccp_huff_build(&rx->dist, lengths, 19))
+		return false;
+
+	for (i = 0; i < nlen + ndist; ) {
+		if ((sym = ccp_decode(s, &rx->dist)) < 0)
+			return false;
+		if (sym < 16) {
+			lengths[i++] = sym;
+			continue;
+		}
+
+		if (sym == 16) {
+			if (i == 0 || (rep = ccp_getbits(s, 2)) < 0)
+				return false;
+			v = lengths[i - 1];
+			rep += 3;
+		} else if (sym == 17) {
+			if ((rep = ccp_getbits(s, 3)) < 0)
+				return false;
+			v = 0;
+			rep += 3;
+		} else {
+			if ((rep = ccp_getbits(s, 7)) < 0)
+				return false;
+			v = 0;
+			rep += 11;
+		}
+		if (i + rep > nlen + ndist)
+			return false;
+		while (rep--)
+			lengths[i++] = v;
+	}
+
+	if (lengths[CCP_EOB] == 0)
+		return false;
+
+	return (ccp_huff_build(&rx->lit, lengths, nlen) &&
+	    ccp_huff_build(&rx->dist, lengths + nlen, ndist));
+}
+
+/*
+ * Inflate one packet's worth of blocks into rx->out, returning the length
+ * or -1.  Every packet ends on a block boundary, usually with the bare
+ * header of a stored block that never comes.
+ */
+static int
+ccp_inflate(struct ccp_rx *rx, const uint8_t *data, size_t len)
+{
+	struct ccp_bitsrc s = { data, len, 0, 0, 0 };
+	size_t out = 0, mlen, dist, slen;
+	int hdr, sym, v;
+
+	for (;;) {
+		if ((hdr = ccp_getbits(&s, 3)) < 0)
+			break;
+
+		switch (hdr >> 1) {
+		case 0:
+			/* stored, starting on the next byte */
+			s.bits = 0;
+			s.nbits = 0;
+			if (s.pos == s.len)
+				return out;
+			if (s.len - s.pos < 4)
+				return -1;
+			slen = data[s.pos] | (data[s.pos + 1] << 8);
+			if ((size_t)(data[s.pos + 2] |
+			    (data[s.pos + 3] << 8)) != (~slen & 0xffff))
+				return -1;
+			s.pos += 4;
+			if (slen > s.len - s.pos || out + slen > CCP_MAX_DATA)
+				return -1;
+			memcpy(rx->out + out, data + s.pos, slen);
+			s.pos += slen;
+			out += slen;
+			continue;
+		case 1:
+			ccp_fixed(rx);
+			break;
+		case 2:
+			if (!ccp_dynamic(rx, &s))
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+
+		for (;;) {
+			if ((sym = ccp_decode(&s, &rx->lit)) < 0)
+				return -1;
+			if (sym < CCP_EOB) {
+				if (out == CCP_MAX_DATA)
+					return -1;
+				rx->out[out++] = sym;
+				continue;
+			}
+			if (sym == CCP_EOB)
+				break;
+
+			sym -= CCP_EOB + 1;
+			if (sym >= 29 ||
+			    (v = ccp_getbits(&s, ccp_len_extra[sym])) < 0)
+				return -1;
+			mlen = ccp_len_base[sym] + v;
+
+			if ((sym = ccp_decode(&s, &rx->dist)) < 0 ||
+			    sym >= 30 ||
+			    (v = ccp_getbits(&s, ccp_dist_extra[sym])) < 0)
+				return -1;
+			dist = ccp_dist_base[sym] + v;
+
+			if (dist > out + rx->wlen || out + mlen > CCP_MAX_DATA)
+				return -1;
+			for (; mlen; mlen--, out++) {
+				if (dist <= out)
+					rx->out[out] = rx->out[out - dist];
+				else
+					rx->out[out] = rx->win[(rx->whead +
+					    CCP_WINDOW - (dist - out)) %
+					    CCP_WINDOW];
+			}
+		}
+	}
+
+	return out;
+}
+
+static void
+ccp_history(struct ccp_rx *rx, const uint8_t *data, size_t len)
+{
+	size_t chunk;
+
+	if (len > CCP_WINDOW) {
+		data += len - CCP_WINDOW;
+		len = CCP_WINDOW;
+	}
+
+	if (rx->wlen + len > CCP_WINDOW)
+		rx->wlen = CCP_WINDOW;
+	else
+		rx->wlen += len;
+
+	while (len) {
+		chunk = CCP_WINDOW - rx->whead;
+		if (chunk > len)
+			chunk = len;
+		memcpy(rx->win + rx->whead, data, chunk);
+		rx->whead = (rx->whead + chunk) % CCP_WINDOW;
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Inflate a compressed datagram (after its protocol field), pointing out
+ * at the protocol field and data that come out.  Returns the length, or -1
+ * if it has to be dropped, in which case we ask the peer to start over.
+ */
+int
+ccp_decompress(const uint8_t *data, size_t len, const uint8_t **out)
+{
+	struct ccp_rx *rx = ccp_rx;
+	int n;
+
+	if (!ccp_rx_running())
+		return -1;
+
+	/* anything until the Reset-Ack is from the old history */
+	if (ccp.reset_pending)
+		return -1;
+
+	if (len < 2 || ((data[0] << 8) | data[1]) != rx->seq ||
+	    (n = ccp_inflate(rx, data + 2, len - 2)) <= 0) {
+		ccp_stats.rx_errors++;
+		ccp_send_resetreq();
+		return -1;
+	}
+
+	ccp_history(rx, rx->out, n);
+	rx->seq++;
+	ccp_stats.rx_wire += len;
+	ccp_stats.rx_bytes += n;
+
+	*out = rx->out;
+	return n;
+}
+
+/* the peer added this uncompressed datagram to its history, so must we */
+void
+ccp_incomp(uint16_t protocol, const uint8_t *data, size_t len)
+{
+	struct ccp_rx *rx = ccp_rx;
+	uint8_t proto[2];
+	size_t n = 0;
+
+	if (!ccp_rx_running() || ccp.reset_pending || protocol > 0x3fff ||
+	    protocol == PPP_COMP || protocol == 0xfb)
+		return;
+
+	if (protocol > 0xff)
+		proto[n++] = protocol >> 8;
+	proto[n++] = protocol & 0xff;
+	ccp_history(rx, proto, n);
+	ccp_history(rx, data, len);
+	rx->seq++;
+
+	ccp_stats.rx_wire += n + len;
+	ccp_stats.rx_bytes += n + len;
+}
@@ -0,0 +1,649 @@
+/*
+ * WiFiPPP
+ * Copyright (c) 2021 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Caching DNS forwarder on the PPP server address, which IPCP hands to
+ * clients as their name server.  Queries we have a fresh answer for are
+ * answered right away; the rest are passed on to WiFi.dnsIP() and their
+ * answers (including NXDOMAIN and no-data answers) cached until their TTL
+ * runs out.
+ */
+
+#include <lwip/udp.h>
+
+#include "wifippp.h"
+
+#define DNSPROXY_PORT		53
+
+#define DNS_HDR_LEN		12
+#define DNS_FLAG_QR		0x80
+#define DNS_FLAG_TC		0x02
+#define DNS_OPCODE(f)		(((f) >> 3) & 0x0f)
+#define DNS_RCODE(f)		((f) & 0x0f)
+#define DNS_RCODE_OK		0
+#define DNS_RCODE_NXDOMAIN	3
+#define DNS_TYPE_SOA		6
+#define DNS_TYPE_OPT		41
+
+/* largest message we'll deal with, a typical EDNS buffer size */
+#define DNSPROXY_MAX_MSG	1232
+
+#define DNSPROXY_CACHE_SLOTS	32
+#define DNSPROXY_CACHE_BYTES	(6 * 1024)
+/* don't hold on to anything longer than this, in seconds */
+#define DNSPROXY_MAX_TTL	(60 * 60)
+/* negative answers without an SOA to tell us how long */
+#define DNSPROXY_NEG_TTL	60
+
+#define DNSPROXY_PENDING	8
+#define DNSPROXY_TIMEOUT	(5 * 1000)
+
+struct dnsproxy_entry {
+	uint8_t *question;	/* lowercased, followed by the answer */
+	uint16_t qlen;
+	uint8_t *msg;
+	uint16_t len;
+	bool edns;
+	bool negative;
+	unsigned long added;
+	unsigned long ttl;
+	unsigned long used;
+};
+
+struct dnsproxy_pending {
+	uint8_t *question;
+	uint16_t qlen;
+	bool edns;
+	uint16_t id;
+	uint16_t client_id;
+	ip_addr_t client_ip;
+	u16_t client_port;
+	unsigned long sent;
+};
+
+struct dnsproxy_stats dnsproxy_stats = { 0 };
+
+static struct udp_pcb *dnsproxy_pcb = NULL;
+static struct udp_pcb *dnsproxy_upstream_pcb = NULL;
+static ip_addr_t dnsproxy_upstream;
+
+static struct dnsproxy_entry dnsproxy_cache[DNSPROXY_CACHE_SLOTS];
+static size_t dnsproxy_cache_bytes = 0;
+static struct dnsproxy_pending dnsproxy_pending[DNSPROXY_PENDING];
+
+static void dnsproxy_query(void *, struct udp_pcb *, struct pbuf *,
+    const ip_addr_t *, u16_t);
+static void dnsproxy_answer(void *, struct udp_pcb *, struct pbuf *,
+    const ip_addr_t *, u16_t);
+
+void
+dnsproxy_setup(void)
+{
+	ip_addr_t addr;
+
+	if (dnsproxy_pcb) {
+		udp_remove(dnsproxy_pcb);
+		dnsproxy_pcb = NULL;
+	}
+
+	if (!dnsproxy_upstream_pcb) {
+		dnsproxy_upstream_pcb = udp_new();
+		if (!dnsproxy_upstream_pcb ||
+		    udp_bind(dnsproxy_upstream_pcb, IP_ADDR_ANY, 0) != ERR_OK) {
+			syslog.log(LOG_ERR, "DNS forwarder: can't set up "
+			    "upstream socket");
+			return;
+		}
+		udp_recv(dnsproxy_upstream_pcb, dnsproxy_answer, NULL);
+	}
+
+	dnsproxy_pcb = udp_new();
+	if (!dnsproxy_pcb) {
+		syslog.log(LOG_ERR, "DNS forwarder: udp_new failed");
+		return;
+	}
+
+	ip_addr_set_ip4_u32(&addr, settings->ppp_server_ip.addr);
+	if (udp_bind(dnsproxy_pcb, &addr, DNSPROXY_PORT) != ERR_OK) {
+		syslog.logf(LOG_ERR, "DNS forwarder: can't bind to %s:%d",
+		    ipaddr_ntoa(&addr), DNSPROXY_PORT);
+		udp_remove(dnsproxy_pcb);
+		dnsproxy_pcb = NULL;
+		return;
+	}
+	udp_recv(dnsproxy_pcb, dnsproxy_query, NULL);
+}
+
+static void
+dnsproxy_pending_free(struct dnsproxy_pending *pq)
+{
+	free(pq->question);
+	pq->question = NULL;
+}
+
+void
+dnsproxy_process(void)
+{
+	unsigned long now = millis();
+	int i;
+
+	for (i = 0; i < DNSPROXY_PENDING; i++) {
+		if (dnsproxy_pending[i].question == NULL ||
+		    now - dnsproxy_pending[i].sent < DNSPROXY_TIMEOUT)
+			continue;
+
+		/* the client will have retried on its own by now */
+		dnsproxy_stats.timeouts++;
+		dnsproxy_pending_free(&dnsproxy_pending[i]);
+	}
+}
+
+void
+dnsproxy_cache_usage(size_t *entries, size_t *bytes)
+{
+	int i;
+
+	*entries = 0;
+	for (i = 0; i < DNSPROXY_CACHE_SLOTS; i++)
+		if (dnsproxy_cache[i].question)
+			(*entries)++;
+
+	*bytes = dnsproxy_cache_bytes;
+}
+
+static uint16_t
+dnsproxy_get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t
+dnsproxy_get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void
+dnsproxy_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+/*
+ * Return the length of the single question after the header, or 0 if
+ * there isn't exactly one well-formed, uncompressed one.
+ */
+static size_t
+dnsproxy_question_len(const uint8_t *msg, size_t len)
+{
+	size_t off = DNS_HDR_LEN;
+
+	if (len < DNS_HDR_LEN || dnsproxy_get16(msg + 4) != 1)
+		return 0;
+
+	while (off < len && msg[off] != 0) {
+		if (msg[off] & 0xc0)
+			return 0;
+		off += msg[off] + 1;
+	}
+
+	/* root label, type, class */
+	off += 1 + 4;
+	if (off > len)
+		return 0;
+
+	return off - DNS_HDR_LEN;
+}
+
+/* a lowercased copy of the question, for matching regardless of case */
+static uint8_t *
+dnsproxy_question_key(const uint8_t *msg, size_t qlen)
+{
+	uint8_t *key;
+	size_t i;
+
+	key = (uint8_t *)malloc(qlen);
+	if (key == NULL)
+		return NULL;
+
+	memcpy(key, msg + DNS_HDR_LEN, qlen);
+
+	/* label lengths are all under 64, so only name bytes are letters */
+	for (i = 0; i < qlen - 4; i++)
+		if (key[i] >= 'A' && key[i] <= 'Z')
+			key[i] += 'a' - 'A';
+
+	return key;
+}
+
+static bool
+dnsproxy_question_match(const uint8_t *key, size_t qlen, const uint8_t *msg,
+    size_t len)
+{
+	size_t i;
+	uint8_t c;
+
+	if (DNS_HDR_LEN + qlen > len)
+		return false;
+
+	for (i = 0; i < qlen; i++) {
+		c = msg[DNS_HDR_LEN + i];
+		if (i < qlen - 4 && c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if (c != key[i])
+			return false;
+	}
+
+	return true;
+}
+
+/* whether the query has an EDNS OPT record, which changes the answer */
+static bool
+dnsproxy_edns(const uint8_t *msg)
+{
+	return (dnsproxy_get16(msg + 10) != 0);
+}
+
+/* skip a possibly-compressed name at off, returning the offset after it */
+static size_t
+dnsproxy_skip_name(const uint8_t *msg, size_t len, size_t off)
+{
+	while (off < len) {
+		if (msg[off] == 0)
+			return off + 1;
+		if ((msg[off] & 0xc0) == 0xc0)
+			return (off + 2 <= len ? off + 2 : 0);
+		if (msg[off] & 0xc0)
+			return 0;
+		off += msg[off] + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Walk every resource record in an answer, finding the lowest TTL (for
+ * SOAs, bounded by the SOA minimum as RFC 2308 says to for negative
+ * caching) and taking age seconds off of each TTL.  Returns false if the
+ * message is malformed.
+ */
+static bool
+dnsproxy_ttls(uint8_t *msg, size_t len, size_t qlen, unsigned long age,
+    unsigned long *min_ttl)
+{
+	size_t off = DNS_HDR_LEN + qlen, rdlen;
+	unsigned int rrs, i;
+	uint32_t ttl;
+	uint16_t type;
+
+	rrs = dnsproxy_get16(msg + 6) + dnsproxy_get16(msg + 8) +
+	    dnsproxy_get16(msg + 10);
+	*min_ttl = DNSPROXY_MAX_TTL;
+
+	for (i = 0; i < rrs; i++) {
+		off = dnsproxy_skip_name(msg, len, off);
+		if (off == 0 || off + 10 > len)
+			return false;
+
+		type = dnsproxy_get16(msg + off);
+		ttl = dnsproxy_get32(msg + off + 4);
+		rdlen = dnsproxy_get16(msg + off + 8);
+		if (off + 10 + rdlen > len)
+			return false;
+
+		/* an OPT record's "TTL" is really flags */
+		if (type != DNS_TYPE_OPT) {
+			if (type == DNS_TYPE_SOA && rdlen >= 4 &&
+			    dnsproxy_get32(msg + off + 10 + rdlen - 4) < ttl)
+				ttl = dnsproxy_get32(msg + off + 10 + rdlen -
+				    4);
+
+			if (ttl < *min_ttl)
+				*min_ttl = ttl;
+
+			if (age) {
+				ttl = (ttl > age ? ttl - age : 0);
+				msg[off + 4] = ttl >> 24;
+				msg[off + 5] = (ttl >> 16) & 0xff;
+				msg[off + 6] = (ttl >> 8) & 0xff;
+				msg[off + 7] = ttl & 0xff;
+			}
+		}
+
+		off += 10 + rdlen;
+	}
+
+	return true;
+}
+
+/*
+ * Lower the UDP payload size advertised in a query's OPT record to what we
+ * can take, so the upstream server truncates bigger answers and the client
+ * retries over TCP instead of us dropping the answer.
+ */
+static void
+dnsproxy_clamp_edns(uint8_t *msg, size_t len, size_t qlen)
+{
+	size_t off = DNS_HDR_LEN + qlen;
+	unsigned int rrs, i;
+
+	rrs = dnsproxy_get16(msg + 6) + dnsproxy_get16(msg + 8) +
+	    dnsproxy_get16(msg + 10);
+
+	for (i = 0; i < rrs; i++) {
+		off = dnsproxy_skip_name(msg, len, off);
+		if (off == 0 || off + 10 > len)
+			return;
+
+		/* an OPT record's class is the payload size */
+		if (dnsproxy_get16(msg + off) == DNS_TYPE_OPT &&
+		    dnsproxy_get16(msg + off + 2) > DNSPROXY_MAX_MSG)
+			dnsproxy_put16(msg + off + 2, DNSPROXY_MAX_MSG);
+
+		off += 10 + dnsproxy_get16(msg + off + 8);
+	}
+}
+
+static void
+dnsproxy_cache_remove(struct dnsproxy_entry *e)
+{
+	dnsproxy_cache_bytes -= e->qlen + e->len;
+	free(e->question);
+	memset(e, 0, sizeof(struct dnsproxy_entry));
+}
+
+static struct dnsproxy_entry *
+dnsproxy_cache_find(const uint8_t *key, size_t qlen, bool edns)
+{
+	unsigned long now = millis();
+	struct dnsproxy_entry *e;
+	int i;
+
+	for (i = 0; i < DNSPROXY_CACHE_SLOTS; i++) {
+		e = &dnsproxy_cache[i];
+		if (e->question == NULL || e->qlen != qlen || e->edns != edns ||
+		    memcmp(e->question, key, qlen) != 0)
+			continue;
+
+		if ((now - e->added) / 1000 >= e->ttl) {
+			dnsproxy_cache_remove(e);
+			return NULL;
+		}
+
+		e->used = now;
+		return e;
+	}
+
+	return NULL;
+}
+
+static void
+dnsproxy_cache_add(const uint8_t *key, size_t qlen, bool edns,
+    const uint8_t *msg, size_t len)
+{
+	struct dnsproxy_entry *e, *lru;
+	unsigned long now = millis(), ttl;
+	uint8_t rcode = DNS_RCODE(msg[3]);
+	bool negative;
+	int i;
+
+	if (DNS_OPCODE(msg[2]) != 0 || (msg[2] & DNS_FLAG_TC))
+		return;
+	if (rcode == DNS_RCODE_NXDOMAIN)
+		negative = true;
+	else if (rcode == DNS_RCODE_OK)
+		negative = (dnsproxy_get16(msg + 6) == 0);
+	else
+		return;
+
+	/* leave room for a few answers rather than one huge one */
+	if (qlen + len > DNSPROXY_CACHE_BYTES / 4)
+		return;
+
+	if (!dnsproxy_ttls((uint8_t *)msg, len, qlen, 0, &ttl))
+		return;
+	if (negative && dnsproxy_get16(msg + 8) == 0)
+		ttl = DNSPROXY_NEG_TTL;
+	if (ttl == 0)
+		return;
+
+	/* clear out anything expired, then the least recently used */
+	for (;;) {
+		lru = NULL;
+		e = NULL;
+		for (i = 0; i < DNSPROXY_CACHE_SLOTS; i++) {
+			if (dnsproxy_cache[i].question == NULL) {
+				if (e == NULL)
+					e = &dnsproxy_cache[i];
+				continue;
+			}
+			if ((now - dnsproxy_cache[i].added) / 1000 >=
+			    dnsproxy_cache[i].ttl) {
+				dnsproxy_cache_remove(&dnsproxy_cache[i]);
+				if (e == NULL)
+					e = &dnsproxy_cache[i];
+				continue;
+			}
+			if (lru == NULL || (long)(dnsproxy_cache[i].used -
+			    lru->used) < 0)
+				lru = &dnsproxy_cache[i];
+		}
+
+		if (e != NULL &&
+		    dnsproxy_cache_bytes + qlen + len <= DNSPROXY_CACHE_BYTES)
+			break;
+		if (lru == NULL)
+			return;
+
+		dnsproxy_cache_remove(lru);
+		dnsproxy_stats.evictions++;
+	}
+
+	e->question = (uint8_t *)malloc(qlen + len);
+	if (e->question == NULL)
+		return;
+
+	memcpy(e->question, key, qlen);
+	e->qlen = qlen;
+	e->msg = e->question + qlen;
+	memcpy(e->msg, msg, len);
+	e->len = len;
+	e->edns = edns;
+	e->negative = negative;
+	e->added = now;
+	e->used = now;
+	e->ttl = ttl;
+
+	dnsproxy_cache_bytes += qlen + len;
+}
+
+static void
+dnsproxy_send(struct udp_pcb *pcb, const uint8_t *msg, size_t len,
+    const ip_addr_t *addr, u16_t port)
+{
+	struct pbuf *p;
+
+	p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+	if (p == NULL) {
+		dnsproxy_stats.errors++;
+		return;
+	}
+
+	memcpy(p->payload, msg, len);
+	if (udp_sendto(pcb, p, addr, port) != ERR_OK)
+		dnsproxy_stats.errors++;
+	pbuf_free(p);
+}
+
+/* a query from a PPP client */
+static void
+dnsproxy_query(__attribute__((unused)) void *arg,
+    __attribute__((unused)) struct udp_pcb *pcb, struct pbuf *p,
+    const ip_addr_t *addr, u16_t port)
+{
+	struct dnsproxy_pending *pq = NULL;
+	struct dnsproxy_entry *e;
+	uint8_t *msg = NULL, *key = NULL;
+	unsigned long ttl;
+	size_t len, qlen;
+	bool edns;
+	int i;
+
+	len = p->tot_len;
+	if (len < DNS_HDR_LEN || len > DNSPROXY_MAX_MSG)
+		goto bad;
+
+	msg = (uint8_t *)malloc(len);
+	if (msg == NULL)
+		goto bad;
+	pbuf_copy_partial(p, msg, len, 0);
+
+	if ((msg[2] & DNS_FLAG_QR) || DNS_OPCODE(msg[2]) != 0 ||
+	    (qlen = dnsproxy_question_len(msg, len)) == 0)
+		goto bad;
+
+	key = dnsproxy_question_key(msg, qlen);
+	if (key == NULL)
+		goto bad;
+	edns = dnsproxy_edns(msg);
+
+	dnsproxy_stats.queries++;
+
+	e = dnsproxy_cache_find(key, qlen, edns);
+	if (e != NULL) {
+		uint8_t *ans = (uint8_t *)malloc(e->len);
+		if (ans == NULL)
+			goto bad;
+
+		/* their ID, their question's case, and our remaining TTLs */
+		memcpy(ans, e->msg, e->len);
+		memcpy(ans, msg, 2);
+		memcpy(ans + DNS_HDR_LEN, msg + DNS_HDR_LEN, qlen);
+		dnsproxy_ttls(ans, e->len, qlen,
+		    (millis() - e->added) / 1000, &ttl);
+
+		dnsproxy_send(dnsproxy_pcb, ans, e->len, addr, port);
+		free(ans);
+
+		if (e->negative)
+			dnsproxy_stats.negative_hits++;
+		else
+			dnsproxy_stats.hits++;
+		goto done;
+	}
+
+	dnsproxy_stats.misses++;
+
+	for (i = 0; i < DNSPROXY_PENDING; i++) {
+		if (dnsproxy_pending[i].question == NULL) {
+			pq = &dnsproxy_pending[i];
+			break;
+		}
+	}
+	if (pq == NULL || WiFi.status() != WL_CONNECTED) {
+		/* the client will retry */
+		dnsproxy_stats.errors++;
+		goto done;
+	}
+
+	pq->question = key;
+	key = NULL;
+	pq->qlen = qlen;
+	pq->edns = edns;
+	pq->client_id = dnsproxy_get16(msg);
+	ip_addr_copy(pq->client_ip, *addr);
+	pq->client_port = port;
+	pq->sent = millis();
+	/* a fresh random ID makes forged answers harder to slip in */
+	pq->id = ESP.random() & 0xffff;
+	dnsproxy_put16(msg, pq->id);
+	if (edns)
+		dnsproxy_clamp_edns(msg, len, qlen);
+
+	ip_addr_set_ip4_u32(&dnsproxy_upstream, (uint32_t)WiFi.dnsIP());
+	dnsproxy_send(dnsproxy_upstream_pcb, msg, len, &dnsproxy_upstream,
+	    DNSPROXY_PORT);
+	goto done;
+
+bad:
+	dnsproxy_stats.errors++;
+done:
+	if (key)
+		free(key);
+	if (msg)
+		free(msg);
+	pbuf_free(p);
+}
+
+/* an answer from the upstream server */
+static void
+dnsproxy_answer(__attribute__((unused)) void *arg,
+    __attribute__((unused)) struct udp_pcb *pcb, struct pbuf *p,
+    const ip_addr_t *addr, u16_t port)
+{
+	struct dnsproxy_pending *pq = NULL;
+	uint8_t *msg = NULL;
+	uint16_t id;
+	size_t len;
+	int i;
+
+	len = p->tot_len;
+	if (len < DNS_HDR_LEN || port != DNSPROXY_PORT ||
+	    !ip_addr_cmp(addr, &dnsproxy_upstream))
+		goto done;
+	if (len > DNSPROXY_MAX_MSG) {
+		/* shouldn't happen now that queries ask for less */
+		dnsproxy_stats.errors++;
+		goto done;
+	}
+
+	msg = (uint8_t *)malloc(len);
+	if (msg == NULL)
+		goto done;
+	pbuf_copy_partial(p, msg, len, 0);
+
+	if (!(msg[2] & DNS_FLAG_QR))
+		goto done;
+
+	id = dnsproxy_get16(msg);
+	for (i = 0; i < DNSPROXY_PENDING; i++) {
+		if (dnsproxy_pending[i].question != NULL &&
+		    dnsproxy_pending[i].id == id &&
+		    dnsproxy_question_match(dnsproxy_pending[i].question,
+		    dnsproxy_pending[i].qlen, msg, len)) {
+			pq = &dnsproxy_pending[i];
+			break;
+		}
+	}
+	if (pq == NULL)
+		goto done;
+
+	dnsproxy_cache_add(pq->question, pq->qlen, pq->edns, msg, len);
+
+	dnsproxy_put16(msg, pq->client_id);
+	if (dnsproxy_pcb)
+		dnsproxy_send(dnsproxy_pcb, msg, len, &pq->client_ip,
+		    pq->client_port);
+	dnsproxy_pending_free(pq);
+
+done:
+	if (msg)
+		free(msg);
+	pbuf_free(p);
+}
@@ -0,0 +1,1282 @@
+/*
+ * WiFiPPP
+ * Copyright (c) 2021 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Async HDLC framing (RFC 1662) for PPP over the serial port, used as the
+ * lwIP PPP link layer instead of pppos.
+ *
+ * pppos escapes and checksums a byte at a time and hands us the result in
+ * small pieces.  Here, a 256-entry table says which bytes are special in
+ * each direction, so runs of ordinary bytes are found four at a time and
+ * copied in one go, and whole frames go into the transmit ring at once.
+ */
+
+#include <lwip/ip.h>
+#include <lwip/pbuf.h>
+#include <netif/ppp/ppp_impl.h>
+
+#include "wifippp.h"
+
+#define HDLC_FLAG		0x7e
+#define HDLC_ESCAPE		0x7d
+#define HDLC_TRANS		0x20
+#define HDLC_ALLSTATIONS	0xff
+#define HDLC_UI			0x03
+
+#define HDLC_INITFCS		0xffff
+#define HDLC_GOODFCS		0xf0b8
+
+/* send an opening flag if the line has been idle this long, to flush noise */
+#define HDLC_MAXIDLEFLAG	100
+
+/* largest frame we'll accept: address, control, protocol, MRU, FCS */
+#define HDLC_RX_BUF_SIZE	(4 + PPP_MRU + 2)
+
+/* bytes escaped per serial_queue() call when transmitting */
+#define HDLC_TX_CHUNK		128
+
+/*
+ * Output scheduling.  Everything in the transmit ring goes out in order
+ * and takes a while at serial speeds, so frames wait here instead: one
+ * queue for interactive traffic that always goes first, and one for bulk
+ * that only feeds the ring as it empties.  Bulk frames that have waited
+ * too long are dropped or ECN-marked, CoDel style, so TCP senders back
+ * off before they can fill the queue.
+ */
+#define HDLC_Q_SLOTS		16
+#define HDLC_Q_INTERACTIVE_BYTES (2 * 1024)
+#define HDLC_Q_BULK_BYTES	(4 * PPP_MRU)
+#define HDLC_Q_BULK_RING	256
+#define HDLC_Q_SMALL		160
+
+enum {
+	HDLC_Q_INTERACTIVE,
+	HDLC_Q_BULK,
+	HDLC_Q_COUNT,
+};
+
+struct hdlc_qent {
+	struct pbuf *p;
+	unsigned long since;
+	u_short protocol;
+	uint8_t hdr[4];
+	uint8_t hlen;
+	bool marked;		/* ECN marked by CoDel, already counted */
+};
+
+struct hdlc_queue {
+	struct hdlc_qent ent[HDLC_Q_SLOTS];
+	uint8_t head;
+	uint8_t count;
+	size_t bytes;
+	size_t limit;
+};
+
+/* receive byte classes, anything else is frame data */
+enum {
+	HDLC_RX_DATA = 0,
+	HDLC_RX_FLAG,
+	HDLC_RX_ESC,
+	HDLC_RX_DROP,
+};
+
+enum {
+	HDLC_STATE_HUNT,
+	HDLC_STATE_DATA,
+	HDLC_STATE_ESC,
+};
+
+struct hdlc_rx {
+	uint8_t state;
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+	void (*frame)(const uint8_t *, size_t);
+};
+
+struct hdlc_stats hdlc_stats = { 0 };
+
+/*
+ * Slice-by-4 FCS tables, built at startup: hdlc_fcstab[0] is the usual
+ * byte-at-a-time table and each following one advances a byte further.
+ */
+static uint16_t hdlc_fcstab[4][256];
+
+/* non-zero for bytes that must be escaped when sending */
+static uint8_t hdlc_tx_class[256];
+/* HDLC_RX_* class of each byte received outside of an escape */
+static uint8_t hdlc_rx_class[256];
+
+static ppp_pcb *hdlc_ppp = NULL;
+static bool hdlc_open = false;
+static bool hdlc_pcomp = false;
+static bool hdlc_accomp = false;
+static unsigned long hdlc_last_xmit = 0;
+
+static uint8_t hdlc_rx_buf[HDLC_RX_BUF_SIZE];
+static struct hdlc_rx hdlc_rx_link;
+
+static struct hdlc_queue hdlc_q[HDLC_Q_COUNT];
+
+/* CoDel state for the bulk queue, per RFC 8289 */
+static struct {
+	unsigned long target;
+	unsigned long interval;
+	unsigned long first_above;
+	unsigned long drop_next;
+	unsigned long count;
+	unsigned long last_count;
+	bool dropping;
+} hdlc_codel;
+
+static void hdlc_connect(ppp_pcb *, void *);
+#if PPP_SERVER
+static void hdlc_listen(ppp_pcb *, void *);
+#endif
+static void hdlc_disconnect(ppp_pcb *, void *);
+static err_t hdlc_destroy(ppp_pcb *, void *);
+static err_t hdlc_write(ppp_pcb *, void *, struct pbuf *);
+static err_t hdlc_netif_output(ppp_pcb *, void *, struct pbuf *, u_short);
+static void hdlc_send_config(ppp_pcb *, void *, u32_t, int, int);
+static void hdlc_recv_config(ppp_pcb *, void *, u32_t, int, int);
+static void hdlc_frame(const uint8_t *, size_t);
+static void hdlc_q_flush(void);
+
+static const struct link_callbacks hdlc_callbacks = {
+	hdlc_connect,
+#if PPP_SERVER
+	hdlc_listen,
+#endif
+	hdlc_disconnect,
+	hdlc_destroy,
+	hdlc_write,
+	hdlc_netif_output,
+	hdlc_send_config,
+	hdlc_recv_config,
+};
+
+static void
+hdlc_fcs_init(void)
+{
+	uint16_t v;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		v = i;
+		for (j = 0; j < 8; j++)
+			v = (v & 1) ? (v >> 1) ^ 0x8408 : (v >> 1);
+		hdlc_fcstab[0][i] = v;
+	}
+
+	for (j = 1; j < 4; j++)
+		for (i = 0; i < 256; i++)
+			hdlc_fcstab[j][i] = (hdlc_fcstab[j - 1][i] >> 8) ^
+			    hdlc_fcstab[0][hdlc_fcstab[j - 1][i] & 0xff];
+}
+
+/*
+ * FCS-16 over data, four bytes per iteration.  Unaligned 32-bit loads
+ * fault on this CPU, so walk up to a word boundary a byte at a time first.
+ */
+static uint16_t
+hdlc_fcs(uint16_t fcs, const uint8_t *data, size_t len)
+{
+	uint32_t w;
+
+	while (len && ((uintptr_t)data & 3)) {
+		fcs = (fcs >> 8) ^ hdlc_fcstab[0][(fcs ^ *data++) & 0xff];
+		len--;
+	}
+
+	while (len >= 4) {
+		w = *(const uint32_t *)data ^ fcs;
+		fcs = hdlc_fcstab[3][w & 0xff] ^
+		    hdlc_fcstab[2][(w >> 8) & 0xff] ^
+		    hdlc_fcstab[1][(w >> 16) & 0xff] ^
+		    hdlc_fcstab[0][w >> 24];
+		data += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		fcs = (fcs >> 8) ^ hdlc_fcstab[0][(fcs ^ *data++) & 0xff];
+
+	return fcs;
+}
+
+/*
+ * Return how many bytes at the start of data are ordinary according to
+ * table, checking four per iteration until one of them isn't.
+ */
+static size_t
+hdlc_run(const uint8_t *table, const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+
+	while (i + 4 <= len && !(table[data[i]] | table[data[i + 1]] |
+	    table[data[i + 2]] | table[data[i + 3]]))
+		i += 4;
+
+	while (i < len && !table[data[i]])
+		i++;
+
+	return i;
+}
+
+/* count the escapes needed to send data, without sending it */
+static size_t
+hdlc_escapes(const uint8_t *table, const uint8_t *data, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i + 4 <= len; i += 4)
+		n += table[data[i]] + table[data[i + 1]] +
+		    table[data[i + 2]] + table[data[i + 3]];
+
+	for (; i < len; i++)
+		n += table[data[i]];
+
+	return n;
+}
+
+/*
+ * Escape len bytes of src into dst, which must have room for twice that,
+ * returning the number of bytes written.
+ */
+static size_t
+hdlc_escape(const uint8_t *table, uint8_t *dst, const uint8_t *src,
+    size_t len)
+{
+	uint8_t *d = dst;
+	size_t run;
+
+	while (len) {
+		run = hdlc_run(table, src, len);
+		memcpy(d, src, run);
+		d += run;
+		src += run;
+		len -= run;
+
+		if (len) {
+			*d++ = HDLC_ESCAPE;
+			*d++ = *src++ ^ HDLC_TRANS;
+			len--;
+		}
+	}
+
+	return d - dst;
+}
+
+/*
+ * Unescape and accumulate received bytes, calling rx->frame with each
+ * complete frame (including its FCS) as its closing flag arrives.
+ */
+static void
+hdlc_unescape(struct hdlc_rx *rx, const uint8_t *data, size_t len)
+{
+	size_t run;
+	uint8_t c;
+
+	while (len) {
+		if (rx->state == HDLC_STATE_DATA) {
+			run = hdlc_run(hdlc_rx_class, data, len);
+			if (run) {
+				if (rx->len + run > rx->size) {
+					/* too long, wait for the next flag */
+					hdlc_stats.rx_discarded++;
+					rx->state = HDLC_STATE_HUNT;
+					rx->len = 0;
+				} else {
+					memcpy(rx->buf + rx->len, data, run);
+					rx->len += run;
+				}
+				data += run;
+				len -= run;
+				continue;
+			}
+		}
+
+		c = *data++;
+		len--;
+
+		if (hdlc_rx_class[c] == HDLC_RX_FLAG) {
+			if (rx->state == HDLC_STATE_ESC) {
+				/* 7d 7e aborts the frame */
+				hdlc_stats.rx_discarded++;
+			} else if (rx->state == HDLC_STATE_DATA && rx->len)
+				rx->frame(rx->buf, rx->len);
+
+			rx->state = HDLC_STATE_DATA;
+			rx->len = 0;
+			continue;
+		}
+
+		switch (rx->state) {
+		case HDLC_STATE_HUNT:
+			break;
+		case HDLC_STATE_ESC:
+			/* noise between the escape and its byte, ignore */
+			if (hdlc_rx_class[c] == HDLC_RX_DROP)
+				break;
+			rx->state = HDLC_STATE_DATA;
+			if (rx->len >= rx->size) {
+				hdlc_stats.rx_discarded++;
+				rx->state = HDLC_STATE_HUNT;
+				rx->len = 0;
+				break;
+			}
+			rx->buf[rx->len++] = c ^ HDLC_TRANS;
+			hdlc_stats.rx_escaped++;
+			break;
+		case HDLC_STATE_DATA:
+			/* HDLC_RX_DROP bytes were added in transit, ignore */
+			if (hdlc_rx_class[c] == HDLC_RX_ESC)
+				rx->state = HDLC_STATE_ESC;
+			break;
+		}
+	}
+}
+
+ppp_pcb *
+hdlc_create(struct netif *nif, ppp_link_status_cb_fn status_cb, void *ctx)
+{
+	if (hdlc_fcstab[0][1] == 0)
+		hdlc_fcs_init();
+
+	hdlc_ppp = ppp_new(nif, &hdlc_callbacks, NULL, status_cb, ctx);
+	return hdlc_ppp;
+}
+
+void
+hdlc_input(const uint8_t *data, size_t len)
+{
+	if (!hdlc_open)
+		return;
+
+	hdlc_stats.rx_bytes += len;
+	hdlc_unescape(&hdlc_rx_link, data, len);
+}
+
+static void
+hdlc_reset(void)
+{
+	unsigned long baud, mtu_ms;
+
+	/* until LCP says otherwise, every control character is escaped */
+	hdlc_send_config(hdlc_ppp, NULL, 0xffffffff, 0, 0);
+	hdlc_recv_config(hdlc_ppp, NULL, 0xffffffff, 0, 0);
+
+	hdlc_rx_link.state = HDLC_STATE_HUNT;
+	hdlc_rx_link.buf = hdlc_rx_buf;
+	hdlc_rx_link.size = sizeof(hdlc_rx_buf);
+	hdlc_rx_link.len = 0;
+	hdlc_rx_link.frame = hdlc_frame;
+
+	hdlc_last_xmit = 0;
+
+	hdlc_q_flush();
+	ccp_reset();
+	hdlc_q[HDLC_Q_INTERACTIVE].limit = HDLC_Q_INTERACTIVE_BYTES;
+	hdlc_q[HDLC_Q_BULK].limit = HDLC_Q_BULK_BYTES;
+
+	/*
+	 * CoDel's usual 5ms target and 100ms interval assume a fast link,
+	 * so stretch both by how long a full-size frame takes to send.
+	 */
+	baud = Serial.baudRate();
+	mtu_ms = (PPP_MRU * 10UL * 1000UL) / (baud ? baud : 9600);
+	hdlc_codel.target = 5 + mtu_ms;
+	hdlc_codel.interval = 100 + (4 * mtu_ms);
+}
+
+static void
+hdlc_connect(ppp_pcb *ppp, __attribute__((unused)) void *ctx)
+{
+	hdlc_reset();
+	hdlc_open = true;
+	ppp_start(ppp);
+}
+
+#if PPP_SERVER
+static void
+hdlc_listen(ppp_pcb *ppp, __attribute__((unused)) void *ctx)
+{
+	hdlc_reset();
+	hdlc_open = true;
+	ppp_start(ppp);
+}
+#endif
+
+static void
+hdlc_disconnect(ppp_pcb *ppp, __attribute__((unused)) void *ctx)
+{
+	hdlc_open = false;
+	hdlc_q_flush();
+	ccp_reset();
+	ppp_link_end(ppp);
+}
+
+static err_t
+hdlc_destroy(__attribute__((unused)) ppp_pcb *ppp,
+    __attribute__((unused)) void *ctx)
+{
+	hdlc_ppp = NULL;
+	return ERR_OK;
+}
+
+static void
+hdlc_send_config(__attribute__((unused)) ppp_pcb *ppp,
+    __attribute__((unused)) void *ctx, u32_t accm, int pcomp, int accomp)
+{
+	int i;
+
+	/*
+	 * With software flow control on, the DTE would eat any XON/XOFF we
+	 * sent, whatever the peer asked for.
+	 */
+	if (settings->reg_i == REG_I_XONXOFF_ON)
+		accm |= (1 << XON) | (1 << XOFF);
+
+	memset(hdlc_tx_class, 0, sizeof(hdlc_tx_class));
+	for (i = 0; i < 32; i++)
+		if (accm & (1UL << i))
+			hdlc_tx_class[i] = 1;
+	hdlc_tx_class[HDLC_FLAG] = 1;
+	hdlc_tx_class[HDLC_ESCAPE] = 1;
+
+	hdlc_pcomp = pcomp;
+	hdlc_accomp = accomp;
+}
+
+static void
+hdlc_recv_config(__attribute__((unused)) ppp_pcb *ppp,
+    __attribute__((unused)) void *ctx, u32_t accm,
+    __attribute__((unused)) int pcomp, __attribute__((unused)) int accomp)
+{
+	int i;
+
+	/*
+	 * Control characters we asked to have escaped can only have been
+	 * added in transit when they arrive bare.  PFC and ACFC are
+	 * detected per-frame, since LCP frames never use them.
+	 */
+	memset(hdlc_rx_class, HDLC_RX_DATA, sizeof(hdlc_rx_class));
+	for (i = 0; i < 32; i++)
+		if (accm & (1UL << i))
+			hdlc_rx_class[i] = HDLC_RX_DROP;
+	hdlc_rx_class[HDLC_FLAG] = HDLC_RX_FLAG;
+	hdlc_rx_class[HDLC_ESCAPE] = HDLC_RX_ESC;
+}
+
+/* take the protocol field off the front of a frame */
+static bool
+hdlc_protocol(const uint8_t **frame, size_t *len, uint16_t *protocol)
+{
+	const uint8_t *f = *frame;
+
+	/* a compressed protocol field is a single odd byte */
+	if (*len >= 1 && (f[0] & 1)) {
+		*protocol = f[0];
+		(*frame)++;
+		(*len)--;
+	} else if (*len >= 2) {
+		*protocol = (f[0] << 8) | f[1];
+		*frame += 2;
+		*len -= 2;
+	} else
+		return false;
+
+	return true;
+}
+
+/* hand a received frame with a good FCS to lwIP */
+static void
+hdlc_frame(const uint8_t *frame, size_t len)
+{
+	struct pbuf *p;
+	uint16_t protocol;
+	uint8_t *payload;
+	int n;
+
+	if (len < 4 || hdlc_fcs(HDLC_INITFCS, frame, len) != HDLC_GOODFCS) {
+		hdlc_stats.rx_fcs_errors++;
+		return;
+	}
+	len -= 2;
+
+	if (frame[0] == HDLC_ALLSTATIONS && frame[1] == HDLC_UI) {
+		frame += 2;
+		len -= 2;
+	}
+
+	if (!hdlc_protocol(&frame, &len, &protocol)) {
+		hdlc_stats.rx_discarded++;
+		return;
+	}
+
+	/* Deflate, which lwIP doesn't know, carries its own protocol field */
+	if (protocol == PPP_COMP) {
+		if ((n = ccp_decompress(frame, len, &frame)) < 0) {
+			hdlc_stats.rx_discarded++;
+			return;
+		}
+		len = n;
+		if (!hdlc_protocol(&frame, &len, &protocol)) {
+			hdlc_stats.rx_discarded++;
+			return;
+		}
+	} else
+		ccp_incomp(protocol, frame, len);
+
+	/*
+	 * Leave room in front for a link header, since NAPT will forward
+	 * most of these right out the WiFi interface.
+	 */
+	p = pbuf_alloc(PBUF_LINK, len + 2, PBUF_RAM);
+	if (p == NULL) {
+		hdlc_stats.rx_nomem++;
+		return;
+	}
+
+	payload = (uint8_t *)p->payload;
+	payload[0] = protocol >> 8;
+	payload[1] = protocol & 0xff;
+	memcpy(payload + 2, frame, len);
+
+	/* IP starts after the protocol field */
+	pbuf_remove_header(p, 2);
+	if (protocol == PPP_IP)
+		ppp_clamp_mss(p, hdlc_ppp->netif->mtu);
+	ppp_account(true, protocol, p);
+
+	hdlc_stats.rx_frames++;
+	if (protocol == PPP_CCP && ccp_input(payload + 2, len)) {
+		pbuf_free(p);
+		return;
+	}
+
+	pbuf_add_header(p, 2);
+	ppp_input(hdlc_ppp, p);
+}
+
+/*
+ * Escape and queue a frame made of a header and a pbuf chain.  The whole
+ * frame is sized first, so it either fits in the transmit ring or is left
+ * for later, rather than leaving half a frame on the wire.
+ */
+static err_t
+hdlc_send(const uint8_t *hdr, size_t hlen, struct pbuf *pb)
+{
+	uint8_t buf[HDLC_TX_CHUNK * 2];
+	uint8_t fcsb[2];
+	struct pbuf *q;
+	uint16_t fcs;
+	size_t need, escapes, off, n, blen;
+	bool flag;
+
+	if (!hdlc_open)
+		return ERR_IF;
+
+	/* don't bother escaping it if it can't possibly fit */
+	if (serial_tx_free() < hlen + pb->tot_len + 3)
+		return ERR_WOULDBLOCK;
+
+	flag = (millis() - hdlc_last_xmit >= HDLC_MAXIDLEFLAG);
+
+	fcs = hdlc_fcs(HDLC_INITFCS, hdr, hlen);
+	escapes = hdlc_escapes(hdlc_tx_class, hdr, hlen);
+	need = hlen;
+	for (q = pb; q != NULL; q = q->next) {
+		fcs = hdlc_fcs(fcs, (const uint8_t *)q->payload, q->len);
+		escapes += hdlc_escapes(hdlc_tx_class,
+		    (const uint8_t *)q->payload, q->len);
+		need += q->len;
+	}
+	fcs ^= 0xffff;
+	fcsb[0] = fcs & 0xff;
+	fcsb[1] = fcs >> 8;
+	escapes += hdlc_escapes(hdlc_tx_class, fcsb, sizeof(fcsb));
+	need += sizeof(fcsb) + escapes + (flag ? 2 : 1);
+
+	if (serial_tx_free() < need)
+		return ERR_WOULDBLOCK;
+
+	blen = 0;
+	if (flag)
+		buf[blen++] = HDLC_FLAG;
+	blen += hdlc_escape(hdlc_tx_class, buf + blen, hdr, hlen);
+
+	for (q = pb; q != NULL; q = q->next) {
+		for (off = 0; off < q->len; off += n) {
+			n = q->len - off;
+			if (n > HDLC_TX_CHUNK)
+				n = HDLC_TX_CHUNK;
+			if (blen + (n * 2) > sizeof(buf)) {
+				serial_queue(buf, blen);
+				blen = 0;
+			}
+			blen += hdlc_escape(hdlc_tx_class, buf + blen,
+			    (const uint8_t *)q->payload + off, n);
+		}
+	}
+
+	if (blen + 5 > sizeof(buf)) {
+		serial_queue(buf, blen);
+		blen = 0;
+	}
+	blen += hdlc_escape(hdlc_tx_class, buf + blen, fcsb, sizeof(fcsb));
+	buf[blen++] = HDLC_FLAG;
+	serial_queue(buf, blen);
+
+	hdlc_last_xmit = millis();
+	hdlc_stats.tx_frames++;
+	hdlc_stats.tx_bytes += need;
+	hdlc_stats.tx_escaped += escapes;
+
+	return ERR_OK;
+}
+
+/* the frame at the front of q, if any */
+static struct hdlc_qent *
+hdlc_q_head(struct hdlc_queue *q)
+{
+	return q->count ? &q->ent[q->head] : NULL;
+}
+
+static void
+hdlc_q_pop(struct hdlc_queue *q)
+{
+	struct hdlc_qent *e = &q->ent[q->head];
+
+	q->bytes -= e->p->tot_len;
+	pbuf_free(e->p);
+	e->p = NULL;
+	q->head = (q->head + 1) % HDLC_Q_SLOTS;
+	q->count--;
+}
+
+static void
+hdlc_q_flush(void)
+{
+	int i;
+
+	for (i = 0; i < HDLC_Q_COUNT; i++)
+		while (hdlc_q[i].count)
+			hdlc_q_pop(&hdlc_q[i]);
+
+	memset(&hdlc_codel, 0, sizeof(hdlc_codel));
+}
+
+/* packets this small are acks, keystrokes, and the like */
+static int
+hdlc_classify(u_short protocol, struct pbuf *pb)
+{
+	const uint8_t *ip = (const uint8_t *)pb->payload;
+	size_t ihl;
+
+	switch (protocol) {
+	case PPP_IP:
+		if (pb->tot_len <= HDLC_Q_SMALL)
+			return HDLC_Q_INTERACTIVE;
+		if (pb->len < IP_HLEN)
+			return HDLC_Q_BULK;
+
+		ihl = (ip[0] & 0x0f) * 4;
+		switch (ip[9]) {
+		case IP_PROTO_ICMP:
+			return HDLC_Q_INTERACTIVE;
+		case IP_PROTO_UDP:
+			if (pb->len >= ihl + 4 &&
+			    (((ip[ihl] << 8) | ip[ihl + 1]) == 53 ||
+			    ((ip[ihl + 2] << 8) | ip[ihl + 3]) == 53))
+				return HDLC_Q_INTERACTIVE;
+			break;
+		}
+		return HDLC_Q_BULK;
+	case PPP_VJC_COMP:
+	case PPP_VJC_UNCOMP:
+		/* always TCP, and there's no port to look at */
+		return (pb->tot_len <= HDLC_Q_SMALL ? HDLC_Q_INTERACTIVE :
+		    HDLC_Q_BULK);
+	default:
+		return HDLC_Q_INTERACTIVE;
+	}
+}
+
+/* takes over the caller's reference to p */
+static err_t
+hdlc_enqueue(int which, struct pbuf *p, u_short protocol,
+    const uint8_t *hdr, size_t hlen)
+{
+	struct hdlc_queue *q = &hdlc_q[which];
+	struct hdlc_qent *e;
+
+	if (!hdlc_open) {
+		pbuf_free(p);
+		return ERR_IF;
+	}
+
+	if (q->count == HDLC_Q_SLOTS || q->bytes + p->tot_len > q->limit) {
+		hdlc_stats.tx_dropped++;
+		pbuf_free(p);
+		return ERR_MEM;
+	}
+
+	e = &q->ent[(q->head + q->count) % HDLC_Q_SLOTS];
+	e->p = p;
+	e->since = millis();
+	e->protocol = protocol;
+	if (hlen)
+		memcpy(e->hdr, hdr, hlen);
+	e->hlen = hlen;
+	e->marked = false;
+
+	q->count++;
+	q->bytes += p->tot_len;
+
+	return ERR_OK;
+}
+
+/*
+ * Mark a queued IPv4 packet Congestion Experienced instead of dropping
+ * it, if its sender said it can handle that.
+ */
+static bool
+hdlc_ecn_mark(struct hdlc_qent *e)
+{
+	uint8_t *ip = (uint8_t *)e->p->payload;
+	uint16_t old;
+	uint32_t sum;
+
+	if (e->protocol != PPP_IP || e->p->len < IP_HLEN || (ip[1] & 3) == 0)
+		return false;
+
+	if ((ip[1] & 3) != 3) {
+		old = (ip[0] << 8) | ip[1];
+		ip[1] |= 3;
+
+		/* RFC 1624 incremental checksum update */
+		sum = (uint16_t)~((ip[10] << 8) | ip[11]) + (uint16_t)~old +
+		    ((ip[0] << 8) | ip[1]);
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = ~sum & 0xffff;
+		ip[10] = sum >> 8;
+		ip[11] = sum & 0xff;
+	}
+
+	e->marked = true;
+	hdlc_stats.codel_marks++;
+	return true;
+}
+
+static void
+hdlc_codel_drop(void)
+{
+	hdlc_q_pop(&hdlc_q[HDLC_Q_BULK]);
+	hdlc_stats.codel_drops++;
+}
+
+static unsigned long
+hdlc_codel_next(unsigned long t)
+{
+	return t + (unsigned long)(hdlc_codel.interval /
+	    sqrt(hdlc_codel.count));
+}
+
+static bool
+hdlc_codel_ok_to_drop(struct hdlc_qent *e, unsigned long now)
+{
+	if (now - e->since < hdlc_codel.target ||
+	    hdlc_q[HDLC_Q_BULK].bytes <= PPP_MRU) {
+		hdlc_codel.first_above = 0;
+		return false;
+	}
+
+	if (hdlc_codel.first_above == 0) {
+		hdlc_codel.first_above = now + hdlc_codel.interval;
+		return false;
+	}
+
+	return ((long)(now - hdlc_codel.first_above) >= 0);
+}
+
+/* RFC 8289's dequeue, returning the bulk frame to send next, if any */
+static struct hdlc_qent *
+hdlc_codel_dequeue(unsigned long now)
+{
+	struct hdlc_queue *q = &hdlc_q[HDLC_Q_BULK];
+	struct hdlc_qent *e;
+	unsigned long delta;
+
+	if ((e = hdlc_q_head(q)) == NULL) {
+		hdlc_codel.first_above = 0;
+		hdlc_codel.dropping = false;
+		return NULL;
+	}
+
+	/*
+	 * Marked on an earlier pass that found no room for it in the ring,
+	 * so CoDel has already had its say about this one.
+	 */
+	if (e->marked)
+		return e;
+
+	if (hdlc_codel.dropping) {
+		if (!hdlc_codel_ok_to_drop(e, now)) {
+			hdlc_codel.dropping = false;
+			return e;
+		}
+
+		while (hdlc_codel.dropping &&
+		    (long)(now - hdlc_codel.drop_next) >= 0) {
+			hdlc_codel.count++;
+			if (hdlc_ecn_mark(e)) {
+				hdlc_codel.drop_next =
+				    hdlc_codel_next(hdlc_codel.drop_next);
+				return e;
+			}
+
+			hdlc_codel_drop();
+			if ((e = hdlc_q_head(q)) == NULL) {
+				hdlc_codel.dropping = false;
+				return NULL;
+			}
+
+			if (!hdlc_codel_ok_to_drop(e, now))
+				hdlc_codel.dropping = false;
+			else
+				hdlc_codel.drop_next =
+				    hdlc_codel_next(hdlc_codel.drop_next);
+		}
+	} else if (hdlc_codel_ok_to_drop(e, now)) {
+		/* enter the dropping state even if this empties the queue */
+		if (!hdlc_ecn_mark(e)) {
+			hdlc_codel_drop();
+			e = hdlc_q_head(q);
+		}
+
+		hdlc_codel.dropping = true;
+		delta = hdlc_codel.count - hdlc_codel.last_count;
+		if (delta > 1 && (long)(now - hdlc_codel.drop_next) <
+		    (long)(16 * hdlc_codel.interval))
+			hdlc_codel.count = delta;
+		else
+			hdlc_codel.count = 1;
+		hdlc_codel.drop_next = hdlc_codel_next(now);
+		hdlc_codel.last_count = hdlc_codel.count;
+	}
+
+	return e;
+}
+
+/* address, control and protocol, compressed as LCP allows */
+static size_t
+hdlc_header(uint8_t *hdr, u_short protocol)
+{
+	size_t hlen = 0;
+
+	if (!hdlc_accomp) {
+		hdr[hlen++] = HDLC_ALLSTATIONS;
+		hdr[hlen++] = HDLC_UI;
+	}
+	if (!hdlc_pcomp || protocol > 0xff)
+		hdr[hlen++] = protocol >> 8;
+	hdr[hlen++] = protocol & 0xff;
+
+	return hlen;
+}
+
+/*
+ * Send a network frame through Deflate if CCP has it going out and it
+ * comes out any smaller, else as it is.  Either way, it only joins the
+ * compressor's history once it's actually in the ring.
+ */
+static err_t
+hdlc_send_comp(struct hdlc_qent *e)
+{
+	struct pbuf *cp;
+	uint8_t hdr[4];
+	err_t err;
+
+	/* don't compress it again each pass while the ring is full */
+	if (serial_tx_free() < (size_t)e->hlen + e->p->tot_len + 3)
+		return ERR_WOULDBLOCK;
+
+	if ((cp = ccp_compress(e->protocol, e->p)) != NULL)
+		err = hdlc_send(hdr, hdlc_header(hdr, PPP_COMP), cp);
+	else
+		err = hdlc_send(e->hdr, e->hlen, e->p);
+
+	if (err == ERR_OK)
+		ccp_commit(cp);
+	if (cp != NULL)
+		pbuf_free(cp);
+
+	return err;
+}
+
+/*
+ * Try to put frame e at the head of q into the transmit ring, returning
+ * false if there's no room for it yet.
+ */
+static bool
+hdlc_q_send(struct hdlc_queue *q, struct hdlc_qent *e, unsigned long now,
+    unsigned long *sent, unsigned long *wait_max)
+{
+	err_t err;
+
+	if (e->protocol && ccp_tx_running())
+		err = hdlc_send_comp(e);
+	else
+		err = hdlc_send(e->hdr, e->hlen, e->p);
+
+	if (err != ERR_OK) {
+		if (serial_tx_queued() > 0)
+			return false;
+
+		/*
+		 * Even an empty ring can't hold it, so it's bigger than the
+		 * MRU and will never go out.
+		 */
+		hdlc_stats.tx_dropped++;
+		hdlc_q_pop(q);
+		return true;
+	}
+
+	(*sent)++;
+	if (now - e->since > *wait_max)
+		*wait_max = now - e->since;
+	hdlc_q_pop(q);
+
+	return true;
+}
+
+void
+hdlc_process(void)
+{
+	struct hdlc_queue *q;
+	struct hdlc_qent *e;
+	unsigned long now = millis();
+
+	q = &hdlc_q[HDLC_Q_INTERACTIVE];
+	while ((e = hdlc_q_head(q)) != NULL)
+		if (!hdlc_q_send(q, e, now, &hdlc_stats.tx_interactive,
+		    &hdlc_stats.interactive_wait_max))
+			return;
+
+	/*
+	 * Only start a bulk frame once the ring has nearly drained, so an
+	 * interactive frame never has to wait behind more than one.
+	 */
+	q = &hdlc_q[HDLC_Q_BULK];
+	while (serial_tx_queued() < HDLC_Q_BULK_RING) {
+		if ((e = hdlc_codel_dequeue(now)) == NULL)
+			break;
+		if (!hdlc_q_send(q, e, now, &hdlc_stats.tx_bulk,
+		    &hdlc_stats.bulk_wait_max))
+			break;
+	}
+}
+
+/* LCP and friends, which arrive with address, control and protocol */
+static err_t
+hdlc_write(__attribute__((unused)) ppp_pcb *ppp,
+    __attribute__((unused)) void *ctx, struct pbuf *p)
+{
+	uint8_t *hdr = (uint8_t *)p->payload;
+	err_t err;
+
+	if (p->len >= 4) {
+		pbuf_remove_header(p, 4);
+		ppp_account(false, (hdr[2] << 8) | hdr[3], p);
+		pbuf_add_header(p, 4);
+	}
+
+	err = hdlc_enqueue(HDLC_Q_INTERACTIVE, p, 0, NULL, 0);
+	hdlc_process();
+
+	return err;
+}
+
+/* a control packet of our own, for protocols lwIP doesn't handle */
+err_t
+hdlc_control(uint16_t protocol, const uint8_t *data, size_t len)
+{
+	struct pbuf *p;
+	uint8_t *d;
+
+	p = pbuf_alloc(PBUF_RAW, 4 + len, PBUF_RAM);
+	if (p == NULL) {
+		hdlc_stats.tx_dropped++;
+		return ERR_MEM;
+	}
+
+	d = (uint8_t *)p->payload;
+	d[0] = HDLC_ALLSTATIONS;
+	d[1] = HDLC_UI;
+	d[2] = protocol >> 8;
+	d[3] = protocol & 0xff;
+	memcpy(d + 4, data, len);
+
+	return hdlc_write(hdlc_ppp, NULL, p);
+}
+
+/* network protocols, which we add the header to, compressed if we can */
+static err_t
+hdlc_netif_output(__attribute__((unused)) ppp_pcb *ppp,
+    __attribute__((unused)) void *ctx, struct pbuf *pb, u_short protocol)
+{
+	struct pbuf *p;
+	uint8_t hdr[4];
+	size_t hlen;
+	err_t err;
+
+	hlen = hdlc_header(hdr, protocol);
+
+	/* pb is still the caller's, so hold our own reference or copy */
+#ifdef PBUF_NEEDS_COPY
+	if (PBUF_NEEDS_COPY(pb)) {
+		p = pbuf_clone(PBUF_RAW, PBUF_RAM, pb);
+		if (p == NULL) {
+			hdlc_stats.tx_dropped++;
+			return ERR_MEM;
+		}
+	} else
+#endif
+	{
+		pbuf_ref(pb);
+		p = pb;
+	}
+
+	if (protocol == PPP_IP)
+		ppp_clamp_mss(p, hdlc_ppp->netif->mtu);
+	ppp_account(false, protocol, p);
+
+	err = hdlc_enqueue(hdlc_classify(protocol, pb), p, protocol, hdr,
+	    hlen);
+	hdlc_process();
+
+	return err;
+}
+
+/*
+ * AT$BENCH: time the escaping, unescaping and FCS paths on this CPU, and
+ * check them against straightforward versions.
+ */
+static size_t hdlc_bench_frames;
+
+static void
+hdlc_bench_frame(__attribute__((unused)) const uint8_t *frame,
+    __attribute__((unused)) size_t len)
+{
+	hdlc_bench_frames++;
+}
+
+/* one bit at a time, straight from RFC 1662 */
+static uint32_t
+hdlc_bench_crc(uint32_t poly, uint32_t fcs, const uint8_t *data, size_t len)
+{
+	int i;
+
+	while (len--) {
+		fcs ^= *data++;
+		for (i = 0; i < 8; i++)
+			fcs = (fcs & 1) ? (fcs >> 1) ^ poly : (fcs >> 1);
+	}
+
+	return fcs;
+}
+
+/*
+ * lwIP's LCP doesn't implement the FCS-Alternatives option so we can't
+ * negotiate FCS-32, but measure what it would cost with the same
+ * slice-by-4 approach.
+ */
+static uint32_t
+hdlc_bench_fcs32(const uint32_t (*tab)[256], uint32_t fcs,
+    const uint8_t *data, size_t len)
+{
+	while (len && ((uintptr_t)data & 3)) {
+		fcs = (fcs >> 8) ^ tab[0][(fcs ^ *data++) & 0xff];
+		len--;
+	}
+
+	while (len >= 4) {
+		fcs ^= *(const uint32_t *)data;
+		fcs = tab[3][fcs & 0xff] ^ tab[2][(fcs >> 8) & 0xff] ^
+		    tab[1][(fcs >> 16) & 0xff] ^ tab[0][fcs >> 24];
+		data += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		fcs = (fcs >> 8) ^ tab[0][(fcs ^ *data++) & 0xff];
+
+	return fcs;
+}
+
+static void
+hdlc_bench_cycles(const char *what, uint32_t cycles, size_t len, bool ok)
+{
+	outputf("%s %lu.%02lu cycles/byte%s\r\n", what,
+	    (unsigned long)(cycles / len),
+	    (unsigned long)(((cycles % len) * 100) / len),
+	    ok ? "" : " MISMATCH");
+}
+
+static void
+hdlc_bench_fcs(const uint8_t *src, size_t len)
+{
+	uint32_t (*tab32)[256];
+	uint32_t t, cycles, ref, fcs32;
+	uint16_t fcs;
+	uint8_t b;
+	size_t i;
+	int j;
+
+	if (hdlc_fcstab[0][1] == 0)
+		hdlc_fcs_init();
+
+	/* start unaligned so the byte-at-a-time edges get checked too */
+	src++;
+	len--;
+
+	ref = hdlc_bench_crc(0x8408, HDLC_INITFCS, src, len);
+
+	fcs = HDLC_INITFCS;
+	t = ESP.getCycleCount();
+	for (i = 0; i < len; i++)
+		fcs = (fcs >> 8) ^ hdlc_fcstab[0][(fcs ^ src[i]) & 0xff];
+	cycles = ESP.getCycleCount() - t;
+	hdlc_bench_cycles("FCS-16 by byte: ", cycles, len, fcs == ref);
+
+	t = ESP.getCycleCount();
+	fcs = hdlc_fcs(HDLC_INITFCS, src, len);
+	cycles = ESP.getCycleCount() - t;
+	hdlc_bench_cycles("FCS-16 by word: ", cycles, len, fcs == ref);
+
+	tab32 = (uint32_t (*)[256])malloc(sizeof(uint32_t) * 4 * 256);
+	if (tab32 == NULL) {
+		output("FCS-32:          not enough memory\r\n");
+		return;
+	}
+
+	for (i = 0; i < 256; i++) {
+		b = i;
+		tab32[0][i] = hdlc_bench_crc(0xedb88320, 0, &b, 1);
+	}
+	for (j = 1; j < 4; j++)
+		for (i = 0; i < 256; i++)
+			tab32[j][i] = (tab32[j - 1][i] >> 8) ^
+			    tab32[0][tab32[j - 1][i] & 0xff];
+
+	ref = hdlc_bench_crc(0xedb88320, 0xffffffff, src, len);
+
+	t = ESP.getCycleCount();
+	fcs32 = hdlc_bench_fcs32(tab32, 0xffffffff, src, len);
+	cycles = ESP.getCycleCount() - t;
+	hdlc_bench_cycles("FCS-32 by word: ", cycles, len, fcs32 == ref);
+	output("FCS-32 framing:  +2 bytes/frame, not negotiated\r\n");
+
+	free(tab32);
+}
+
+void
+hdlc_bench(void)
+{
+	static const u32_t accms[] = { 0xffffffff, 0x000a0000, 0 };
+	uint8_t save_tx[sizeof(hdlc_tx_class)], save_rx[sizeof(hdlc_rx_class)];
+	struct hdlc_stats save_stats = hdlc_stats;
+	const size_t len = 1500;
+	struct hdlc_rx rx;
+	uint8_t *src, *enc, *dec;
+	uint32_t seed = 1, t, tx_cycles, rx_cycles;
+	size_t i, elen;
+
+	src = (uint8_t *)malloc(len);
+	enc = (uint8_t *)malloc((len * 2) + 2);
+	dec = (uint8_t *)malloc(len);
+	if (src == NULL || enc == NULL || dec == NULL) {
+		output("\nnot enough memory\r\n");
+		goto done;
+	}
+
+	/* random bytes, like compressed or encrypted payloads */
+	for (i = 0; i < len; i++) {
+		seed = (seed * 1103515245) + 12345;
+		src[i] = seed >> 16;
+	}
+
+	memcpy(save_tx, hdlc_tx_class, sizeof(save_tx));
+	memcpy(save_rx, hdlc_rx_class, sizeof(save_rx));
+
+	rx.buf = dec;
+	rx.size = len;
+	rx.frame = hdlc_bench_frame;
+
+	output("\n");
+	for (i = 0; i < sizeof(accms) / sizeof(accms[0]); i++) {
+		/* set tables without the XON/XOFF override */
+		memset(hdlc_tx_class, 0, sizeof(hdlc_tx_class));
+		for (int b = 0; b < 32; b++)
+			if (accms[i] & (1UL << b))
+				hdlc_tx_class[b] = 1;
+		hdlc_tx_class[HDLC_FLAG] = 1;
+		hdlc_tx_class[HDLC_ESCAPE] = 1;
+		hdlc_recv_config(NULL, NULL, accms[i], 0, 0);
+
+		enc[0] = HDLC_FLAG;
+		t = ESP.getCycleCount();
+		elen = hdlc_escape(hdlc_tx_class, enc + 1, src, len) + 1;
+		tx_cycles = ESP.getCycleCount() - t;
+		enc[elen++] = HDLC_FLAG;
+
+		rx.state = HDLC_STATE_HUNT;
+		rx.len = 0;
+		hdlc_bench_frames = 0;
+		t = ESP.getCycleCount();
+		hdlc_unescape(&rx, enc, elen);
+		rx_cycles = ESP.getCycleCount() - t;
+
+		outputf("ACCM %08lx: +%zu.%zu%% escaped, "
+		    "tx %lu.%02lu rx %lu.%02lu cycles/byte%s\r\n",
+		    (unsigned long)accms[i],
+		    ((elen - 2 - len) * 100) / len,
+		    (((elen - 2 - len) * 1000) / len) % 10,
+		    (unsigned long)(tx_cycles / len),
+		    (unsigned long)(((tx_cycles % len) * 100) / len),
+		    (unsigned long)(rx_cycles / len),
+		    (unsigned long)(((rx_cycles % len) * 100) / len),
+		    (hdlc_bench_frames == 1 && rx.len == 0 &&
+		    memcmp(src, dec, len) == 0) ? "" : " MISMATCH");
+	}
+
+	memcpy(hdlc_tx_class, save_tx, sizeof(hdlc_tx_class));
+	memcpy(hdlc_rx_class, save_rx, sizeof(hdlc_rx_class));
+	hdlc_stats = save_stats;
+
+	hdlc_bench_fcs(src, len);
+
+done:
+	if (src)
+		free(src);
+	if (enc)
+		free(enc);
+	if (dec)
+		free(dec);
+}
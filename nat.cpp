@@ -0,0 +1,306 @@
+/*
+ * WiFiPPP
+ * Copyright (c) 2021 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * NAPT table setup, and tracking of the flows going through it.
+ *
+ * lwIP's NAPT table is allocated once and can't be resized, and its
+ * timeouts are compiled into the core's lwIP library, so we size it once
+ * from free heap, but never below lwIP's default IP_NAPT_MAX.  Since lwIP
+ * gives no way to look inside it, we also watch the client's packets go
+ * by on the link and keep a short list of the most recently seen flows
+ * with their age and byte counts.  This list is only for statistics; it
+ * has no effect on what lwIP keeps in or expires from its NAPT table.
+ */
+
+#include <lwip/ip.h>
+#include <lwip/napt.h>
+#include <lwip/prot/tcp.h>
+
+#include "wifippp.h"
+
+/*
+ * sizeof(struct napt_table) in lwIP's NAPT: last, src and dest, sport,
+ * dport and mport, proto, the flag bits, and the next/prev indexes
+ */
+#define NAT_ENTRY_SIZE		24
+/* let the NAPT table have at most this share of free heap */
+#define NAT_HEAP_DIVISOR	4
+/* the table is indexed by u16_t, but keep well clear of that */
+#define NAT_MAX_ENTRIES		4096
+
+#define NAT_FLOWS		48
+
+/* lwIP's VJ keeps at most this many connection slots per direction */
+#define NAT_VJ_SLOTS		16
+
+enum {
+	NAT_FLOW_FREE,
+	NAT_FLOW_OPEN,
+	NAT_FLOW_CLOSED,
+};
+
+struct nat_flow {
+	uint32_t remote;
+	uint16_t rport;
+	uint16_t lport;
+	uint8_t proto;
+	uint8_t state;
+	unsigned long first;
+	unsigned long last;
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+};
+
+struct nat_stats nat_stats = { 0 };
+
+static unsigned long nat_entries = 0;
+
+static struct nat_flow nat_flows[NAT_FLOWS];
+/* flow index + 1 for each VJ connection slot, per direction */
+static uint8_t nat_vj_map[2][NAT_VJ_SLOTS];
+static uint8_t nat_vj_last[2];
+
+bool
+nat_setup(void)
+{
+	static bool done = false;
+	unsigned long entries;
+	err_t ret;
+
+	if (done)
+		return true;
+
+	if (settings->napt_max &&
+	    settings->napt_max * NAT_ENTRY_SIZE <= ESP.getFreeHeap() / 2)
+		entries = settings->napt_max;
+	else {
+		if (settings->napt_max)
+			syslog.logf(LOG_WARNING, "NAPT size %u too large for "
+			    "free mem %d, sizing automatically",
+			    settings->napt_max, ESP.getFreeHeap());
+		/* never smaller than lwIP's own default */
+		entries = (ESP.getFreeHeap() / NAT_HEAP_DIVISOR) /
+		    NAT_ENTRY_SIZE;
+		if (entries < IP_NAPT_MAX)
+			entries = IP_NAPT_MAX;
+		if (entries > NAT_MAX_ENTRIES)
+			entries = NAT_MAX_ENTRIES;
+	}
+
+	ret = ip_napt_init(entries, IP_PORTMAP_MAX);
+	if (ret == ERR_BUF) {
+		/*
+		 * Something else already set it up, and lwIP won't tell us
+		 * how big, so don't claim our size was used.
+		 */
+		syslog.logf(LOG_WARNING, "NAPT already initialized, size %lu "
+		    "not applied", entries);
+		done = true;
+		return true;
+	} else if (ret != ERR_OK) {
+		syslog.logf(LOG_ERR, "NAPT initialization failed (%d)",
+		    (int)ret);
+		return false;
+	}
+
+	nat_entries = entries;
+	done = true;
+
+	syslog.logf(LOG_INFO, "NAPT table sized for %lu translations, "
+	    "free mem %d", entries, ESP.getFreeHeap());
+
+	return true;
+}
+
+static void
+nat_flow_free(struct nat_flow *f)
+{
+	uint8_t idx = (f - nat_flows) + 1;
+	int d, s;
+
+	for (d = 0; d < 2; d++)
+		for (s = 0; s < NAT_VJ_SLOTS; s++)
+			if (nat_vj_map[d][s] == idx)
+				nat_vj_map[d][s] = 0;
+
+	f->state = NAT_FLOW_FREE;
+}
+
+static struct nat_flow *
+nat_flow_find(uint8_t proto, uint16_t lport, uint32_t remote, uint16_t rport)
+{
+	struct nat_flow *f, *free_f = NULL, *lru_f = NULL;
+	int i;
+
+	for (i = 0; i < NAT_FLOWS; i++) {
+		f = &nat_flows[i];
+		if (f->state == NAT_FLOW_FREE) {
+			if (free_f == NULL)
+				free_f = f;
+			continue;
+		}
+		if (f->proto == proto && f->lport == lport &&
+		    f->remote == remote && f->rport == rport)
+			return f;
+
+		if (lru_f == NULL || (long)(f->last - lru_f->last) < 0)
+			lru_f = f;
+	}
+
+	/* a free slot, else forget the least recently seen flow */
+	if ((f = free_f) == NULL) {
+		f = lru_f;
+		nat_flow_free(f);
+	}
+
+	memset(f, 0, sizeof(struct nat_flow));
+	f->proto = proto;
+	f->lport = lport;
+	f->remote = remote;
+	f->rport = rport;
+	f->state = NAT_FLOW_OPEN;
+	f->first = f->last = millis();
+
+	nat_stats.flows++;
+
+	return f;
+}
+
+/*
+ * Account for a packet crossing the PPP link, inbound from the client or
+ * outbound to it, given its PPP protocol.
+ */
+void
+nat_track(bool inbound, uint16_t protocol, struct pbuf *p)
+{
+	const uint8_t *pkt = (const uint8_t *)p->payload, *l4;
+	size_t len = p->len;
+	struct nat_flow *f;
+	uint32_t remote;
+	uint16_t lport = 0, rport = 0;
+	uint8_t proto, slot = 0;
+	size_t ihl;
+	int d = inbound ? 0 : 1;
+
+	switch (protocol) {
+	case PPP_IP:
+	case PPP_VJC_UNCOMP:
+		if (len < IP_HLEN || (pkt[0] >> 4) != 4)
+			return;
+		ihl = (pkt[0] & 0x0f) * 4;
+		if (ihl < IP_HLEN || len < ihl)
+			return;
+
+		/* VJ replaces the protocol with its connection slot */
+		if (protocol == PPP_VJC_UNCOMP) {
+			proto = IP_PROTO_TCP;
+			slot = pkt[9];
+		} else
+			proto = pkt[9];
+
+		if (inbound)
+			memcpy(&remote, pkt + 16, sizeof(remote));
+		else
+			memcpy(&remote, pkt + 12, sizeof(remote));
+
+		/* our own SOCKS and DNS services aren't translated */
+		if (remote == settings->ppp_server_ip.addr)
+			return;
+
+		l4 = pkt + ihl;
+		if (proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) {
+			if (len < ihl + 4)
+				return;
+			lport = (l4[inbound ? 0 : 2] << 8) |
+			    l4[(inbound ? 0 : 2) + 1];
+			rport = (l4[inbound ? 2 : 0] << 8) |
+			    l4[(inbound ? 2 : 0) + 1];
+		} else if (proto != IP_PROTO_ICMP)
+			return;
+
+		f = nat_flow_find(proto, lport, remote, rport);
+
+		if (proto == IP_PROTO_TCP && len >= ihl + TCP_HLEN &&
+		    (l4[13] & (TCP_FIN | TCP_RST)))
+			f->state = NAT_FLOW_CLOSED;
+
+		if (protocol == PPP_VJC_UNCOMP && slot < NAT_VJ_SLOTS) {
+			nat_vj_map[d][slot] = (f - nat_flows) + 1;
+			nat_vj_last[d] = slot;
+		}
+		break;
+	case PPP_VJC_COMP:
+		/* the slot is only sent when it changes */
+		if (len < 1)
+			return;
+		if ((pkt[0] & 0x40) && len >= 2)
+			nat_vj_last[d] = pkt[1];
+		if (nat_vj_last[d] >= NAT_VJ_SLOTS ||
+		    nat_vj_map[d][nat_vj_last[d]] == 0)
+			return;
+		f = &nat_flows[nat_vj_map[d][nat_vj_last[d]] - 1];
+		break;
+	default:
+		return;
+	}
+
+	f->last = millis();
+	if (inbound)
+		f->bytes_out += p->tot_len;
+	else
+		f->bytes_in += p->tot_len;
+}
+
+/* ATI9: list the flows most recently seen going through NAPT */
+void
+nat_dump(void)
+{
+	struct nat_flow *f;
+	unsigned long now = millis();
+	ip4_addr_t c_addr, r_addr;
+	char client[16];
+	int i;
+
+	ip_addr_copy(c_addr, settings->ppp_client_ip);
+	strlcpy(client, ipaddr_ntoa(&c_addr), sizeof(client));
+
+	output("\n");
+	if (nat_entries)
+		outputf("NAPT table size:   %lu (%s)\r\n", nat_entries,
+		    settings->napt_max ? "fixed" : "sized from free heap");
+	else
+		output("NAPT table size:   unknown\r\n");
+	outputf("Flows seen:        %lu\r\n", nat_stats.flows);
+	outputf("Recent flows (statistics only, not the NAPT table):\r\n");
+
+	for (i = 0; i < NAT_FLOWS; i++) {
+		f = &nat_flows[i];
+		if (f->state == NAT_FLOW_FREE)
+			continue;
+
+		ip4_addr_set_u32(&r_addr, f->remote);
+		outputf("%s %s:%u %s:%u %s age %lus idle %lus in %lu out "
+		    "%lu\r\n",
+		    f->proto == IP_PROTO_TCP ? "tcp " :
+		    f->proto == IP_PROTO_UDP ? "udp " : "icmp",
+		    client, f->lport, ipaddr_ntoa(&r_addr), f->rport,
+		    f->state == NAT_FLOW_CLOSED ? "closed" : "open",
+		    (now - f->first) / 1000, (now - f->last) / 1000,
+		    f->bytes_in, f->bytes_out);
+	}
+}
@@ -92,6 +92,7 @@ pixel_color_by_state(void)
 			color = pixel.Color(0, 255, 0);
 			break;
 		case STATE_PPP:
+		case STATE_SLIP:
 			/* blue */
 			color = pixel.Color(0, 0, 255);
 			break;
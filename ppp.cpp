@@ -15,51 +15,205 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <lwip/ip.h>
 #include <lwip/napt.h>
 #include <lwip/netif.h>
+#include <lwip/prot/tcp.h>
 #include <netif/ppp/ppp.h>
-#include <netif/ppp/pppos.h>
 
 #include "wifippp.h"
 
-#define PPP_BUF_SIZE 128
+#define PPP_BUF_SIZE 512
 static uint8_t ppp_buf[PPP_BUF_SIZE];
+
+struct ppp_stats ppp_stats = { 0 };
+struct ppp_session ppp_session = { 0 };
+
+const char *ppp_stats_proto_names[PPP_STATS_PROTOS] = {
+	"TCP", "UDP", "ICMP", "other IP", "PPP control",
+};
+
+/* LCP codes we look at, from RFC 1661 */
+#define LCP_CONFNAK	3
+#define LCP_CONFREJ	4
+#define LCP_ECHOREQ	9
+#define LCP_ECHOREP	10
+
+/* link counters at the start of the session, to report its share */
+static struct hdlc_stats ppp_session_hdlc;
+static unsigned long ppp_session_last_tick = 0;
+static unsigned long ppp_session_last_in = 0, ppp_session_last_out = 0;
+
+/* our outstanding LCP Echo-Request, if any */
+static unsigned long ppp_echo_sent = 0;
+static uint8_t ppp_echo_id = 0;
+
+/*
+ * lwIP's VJ stats don't count bytes, but a compressed header replaces the
+ * 40 byte TCP/IP header with usually 3 to 7, so estimate savings from that.
+ */
+#define VJ_EST_SAVED 35
+#if VJ_SUPPORT && LINK_STATS
+static struct vjstat vj_last;
+#endif
 static struct netif ppp_netif;
 static ppp_pcb *_ppp = NULL;
 
 #define PPP_TIMEOUT_SECS (60 * 10)
 long last_ppp_input = 0;
 
-u32_t ppp_output_cb(ppp_pcb *pcb, u8_t *data, u32_t len, void *ctx);
+/*
+ * LCP and IPCP Configure-Requests are resent after this many seconds
+ * without an answer, plus however long a request and its reply take on
+ * the wire at the current baud rate.  The RFC 1661 default of 3 seconds
+ * makes every lost or ignored request cost dialers a long wait.
+ */
+#define PPP_RESTART_SECS	1
+#define PPP_RESTART_MAX_SECS	3
+#define PPP_CONFREQ_BYTES	64
+
+static unsigned long ppp_connect_time = 0;
+
+/*
+ * With no MRU configured, the link MTU starts at whatever LCP settled on,
+ * normally the client's MRU, and steps down when too many frames from the
+ * client arrive damaged, since a noisy line loses more of the big ones.
+ * We then send smaller packets and clamp new connections' MSS to match,
+ * and upstream hosts find the new size through path MTU discovery.  It
+ * steps back up once the line has been clean for a while.
+ */
+#define PPP_MTU_WINDOW_MS	10000
+#define PPP_MTU_MIN_FRAMES	20
+#define PPP_MTU_ERROR_PCT	3
+#define PPP_MTU_CLEAN_WINDOWS	6
+static const uint16_t ppp_mtu_steps[] = { 1500, 1006, 576, 296 };
+#define PPP_MTU_STEPS	(sizeof(ppp_mtu_steps) / sizeof(ppp_mtu_steps[0]))
+static unsigned long ppp_mtu_last = 0;
+static unsigned long ppp_mtu_frames = 0, ppp_mtu_errors = 0;
+static unsigned int ppp_mtu_clean = 0;
+
 void ppp_status_cb(ppp_pcb* pcb, int err_code, void *ctx);
-void ppp_setup_nat(struct netif *nif);
+static void ppp_mtu_adapt(void);
 
+/*
+ * Allocate the PPP control block and its netif once, and reuse them for
+ * every session rather than building and tearing them down on each dial.
+ */
 bool
-ppp_start(void)
+ppp_setup(void)
 {
-	ip4_addr_t s_addr, c_addr, d_addr;
+	if (_ppp)
+		return true;
 
-	_ppp = pppos_create(&ppp_netif, ppp_output_cb, ppp_status_cb, nullptr);
+	_ppp = hdlc_create(&ppp_netif, ppp_status_cb, nullptr);
 	if (!_ppp) {
-		syslog.log(LOG_ERR, "pppos_create failed");
+		syslog.log(LOG_ERR, "hdlc_create failed");
 		return false;
 	}
 
+	/* offer address/control and protocol field compression both ways */
+	_ppp->lcp_wantoptions.neg_accompression = 1;
+	_ppp->lcp_wantoptions.neg_pcompression = 1;
+	_ppp->lcp_allowoptions.neg_asyncmap = 1;
+	_ppp->lcp_allowoptions.neg_accompression = 1;
+	_ppp->lcp_allowoptions.neg_pcompression = 1;
+
+	/*
+	 * Send our Configure-Request as soon as we answer instead of waiting
+	 * for the client to go first, but if it doesn't answer before we
+	 * run out of retries, keep waiting for it like a passive server so
+	 * clients started by hand after CONNECT still work.
+	 */
+	_ppp->lcp_wantoptions.passive = 1;
+	_ppp->lcp_wantoptions.silent = 0;
+
+	/* also sizes the NAPT table while the heap is still unfragmented */
+	nat_setup();
+
+	return true;
+}
+
+bool
+ppp_start(void)
+{
+	ip4_addr_t s_addr, c_addr, d_addr;
+	unsigned long baud, restart;
+
+	if (!ppp_setup())
+		return false;
+
 	ip_addr_copy(s_addr, settings->ppp_server_ip);
 	ip_addr_copy(c_addr, settings->ppp_client_ip);
 
 	ppp_set_ipcp_ouraddr(_ppp, &s_addr);
 	ppp_set_ipcp_hisaddr(_ppp, &c_addr); /* or hers! */
 
+	/*
+	 * Point the client at our caching forwarder first, with the real
+	 * server as a fallback.
+	 */
+	ppp_set_ipcp_dnsaddr(_ppp, 0, &s_addr);
 	ip4_addr_set_u32(&d_addr, WiFi.dnsIP());
-	ppp_set_ipcp_dnsaddr(_ppp, 0, &d_addr);
+	ppp_set_ipcp_dnsaddr(_ppp, 1, &d_addr);
+
+	/*
+	 * Ask for no control characters to be escaped, except XON/XOFF when
+	 * software flow control would eat them.
+	 */
+	_ppp->lcp_wantoptions.neg_asyncmap = 1;
+	_ppp->lcp_wantoptions.asyncmap = 0;
+	if (settings->reg_i == REG_I_XONXOFF_ON)
+		_ppp->lcp_wantoptions.asyncmap |= (1 << XON) | (1 << XOFF);
+
+	baud = Serial.baudRate();
+	restart = PPP_RESTART_SECS + (2 * PPP_CONFREQ_BYTES * 10) /
+	    (baud ? baud : 9600);
+	if (restart > PPP_RESTART_MAX_SECS)
+		restart = PPP_RESTART_MAX_SECS;
+	_ppp->settings.fsm_timeout_time = restart;
+
+	/* notice a dead link without waiting for PPP_TIMEOUT_SECS */
+	_ppp->settings.lcp_echo_interval = settings->lcp_echo_interval;
+	_ppp->settings.lcp_echo_fails = settings->lcp_echo_fails;
+
+	/* a fixed MRU is asked for and also caps what we send */
+	if (settings->ppp_mru) {
+		_ppp->lcp_wantoptions.neg_mru = 1;
+		_ppp->lcp_wantoptions.mru = settings->ppp_mru;
+		_ppp->lcp_allowoptions.mru = settings->ppp_mru;
+	} else {
+		_ppp->lcp_wantoptions.mru = PPP_DEFMRU;
+		_ppp->lcp_allowoptions.mru = PPP_MRU;
+	}
+
+#if VJ_SUPPORT
+	/* Van Jacobson TCP/IP header compression, both ways */
+	_ppp->ipcp_wantoptions.neg_vj = settings->ppp_vj;
+	_ppp->ipcp_allowoptions.neg_vj = settings->ppp_vj;
+#endif
+
+	/*
+	 * lwIP only knows MPPE for CCP, so hdlc.cpp hands CCP to ccp.cpp for
+	 * Deflate instead.  With AT$CCP=0, lwIP Protocol-Rejects it.
+	 */
 
 	outputf("CONNECT %d %s:PPP\r\n", Serial.baudRate(),
 	    ipaddr_ntoa(&s_addr));
 	serial_dcd(true);
 
-	last_ppp_input = millis();
-	ppp_listen(_ppp);
+	last_ppp_input = ppp_connect_time = millis();
+	ppp_session_begin();
+
+	if (ppp_connect(_ppp, 0) != ERR_OK) {
+		syslog.log(LOG_ERR, "ppp_connect failed");
+		serial_dcd(false);
+		return false;
+	}
+
+#if VJ_SUPPORT && LINK_STATS
+	/* lwIP resets VJ state for the new session */
+	vj_last = _ppp->vj_comp.stats;
+#endif
 
 #ifdef PPP_TRACE
 	syslog.log(LOG_INFO, "starting PPP negotiation");
@@ -68,23 +222,324 @@ ppp_start(void)
 	return true;
 }
 
-u32_t
-ppp_output_cb(__attribute__((unused)) ppp_pcb *pcb, u8_t *data, u32_t len,
-    __attribute__((unused)) void *ctx)
+/* pull in counters that lwIP keeps for the current session */
+void
+ppp_stats_update(void)
 {
-#ifdef PPP_TRACE
-	long now = millis();
+#if VJ_SUPPORT && LINK_STATS
+	struct vjstat *vjs;
+
+	if (_ppp == NULL)
+		return;
+
+	vjs = &_ppp->vj_comp.stats;
+
+	ppp_stats.vj_packets += vjs->vjs_packets - vj_last.vjs_packets;
+	ppp_stats.vj_compressed += vjs->vjs_compressed -
+	    vj_last.vjs_compressed;
+	ppp_stats.vj_compressed_in += vjs->vjs_compressedin -
+	    vj_last.vjs_compressedin;
+	ppp_stats.vj_saved = ppp_stats.vj_compressed * VJ_EST_SAVED;
+
+	vj_last = *vjs;
 #endif
+}
+
+/*
+ * Count a packet crossing the link, inbound from the client or outbound
+ * to it, by what it carries.  p starts after the protocol field.
+ */
+void
+ppp_account(bool inbound, uint16_t protocol, struct pbuf *p)
+{
+	const uint8_t *pkt = (const uint8_t *)p->payload;
+	unsigned long rtt;
+	int proto;
+
+	switch (protocol) {
+	case PPP_IP:
+		if (p->len < IP_HLEN)
+			proto = PPP_STATS_IP_OTHER;
+		else if (pkt[9] == IP_PROTO_TCP)
+			proto = PPP_STATS_TCP;
+		else if (pkt[9] == IP_PROTO_UDP)
+			proto = PPP_STATS_UDP;
+		else if (pkt[9] == IP_PROTO_ICMP)
+			proto = PPP_STATS_ICMP;
+		else
+			proto = PPP_STATS_IP_OTHER;
+		break;
+	case PPP_VJC_COMP:
+	case PPP_VJC_UNCOMP:
+		proto = PPP_STATS_TCP;
+		break;
+	case PPP_LCP:
+		proto = PPP_STATS_CONTROL;
+		if (inbound)
+			ppp_stats.lcp_in++;
+		else
+			ppp_stats.lcp_out++;
+		if (p->len < 4)
+			break;
+		if (pkt[0] == LCP_CONFNAK || pkt[0] == LCP_CONFREJ)
+			ppp_stats.conf_naks++;
+		else if (pkt[0] == LCP_ECHOREQ && !inbound) {
+			ppp_echo_sent = millis();
+			ppp_echo_id = pkt[1];
+		} else if (pkt[0] == LCP_ECHOREP && inbound && ppp_echo_sent &&
+		    pkt[1] == ppp_echo_id) {
+			rtt = millis() - ppp_echo_sent;
+			ppp_echo_sent = 0;
+			ppp_stats.echo_rtt = rtt;
+			if (rtt > ppp_stats.echo_rtt_max)
+				ppp_stats.echo_rtt_max = rtt;
+			/* smoothed like TCP's SRTT */
+			if (ppp_stats.echo_rtt_avg == 0)
+				ppp_stats.echo_rtt_avg = rtt;
+			else
+				ppp_stats.echo_rtt_avg =
+				    (7 * ppp_stats.echo_rtt_avg + rtt) / 8;
+		}
+		break;
+	case PPP_IPCP:
+		proto = PPP_STATS_CONTROL;
+		if (inbound)
+			ppp_stats.ipcp_in++;
+		else
+			ppp_stats.ipcp_out++;
+		if (p->len >= 1 &&
+		    (pkt[0] == LCP_CONFNAK || pkt[0] == LCP_CONFREJ))
+			ppp_stats.conf_naks++;
+		break;
+	default:
+		proto = PPP_STATS_CONTROL;
+		break;
+	}
+
+	if (inbound) {
+		ppp_stats.bytes_in[proto] += p->tot_len;
+		ppp_session.bytes_in += p->tot_len;
+	} else {
+		ppp_stats.bytes_out[proto] += p->tot_len;
+		ppp_session.bytes_out += p->tot_len;
+	}
+
+	nat_track(inbound, protocol, p);
+}
+
+/* start counting a new PPP or SLIP session */
+void
+ppp_session_begin(void)
+{
+	memset(&ppp_session, 0, sizeof(ppp_session));
+	ppp_session.start = ppp_session_last_tick = millis();
+	ppp_session_last_in = ppp_session_last_out = 0;
+	ppp_session_hdlc = hdlc_stats;
+	ppp_echo_sent = 0;
+	ppp_stats.sessions++;
+}
+
+/* per-second throughput for the current session */
+void
+ppp_session_tick(void)
+{
+	unsigned long now = millis();
+
+	if (now - ppp_session_last_tick < 1000)
+		return;
+
+	ppp_session.rate_in = (ppp_session.bytes_in - ppp_session_last_in) *
+	    1000 / (now - ppp_session_last_tick);
+	ppp_session.rate_out = (ppp_session.bytes_out -
+	    ppp_session_last_out) * 1000 / (now - ppp_session_last_tick);
+	ppp_session_last_in = ppp_session.bytes_in;
+	ppp_session_last_out = ppp_session.bytes_out;
+	ppp_session_last_tick = now;
+}
+
+/* sum up a finished session in syslog */
+void
+ppp_session_end(const char *link)
+{
+	unsigned long secs;
+
+	ppp_session.end = millis();
+	secs = (ppp_session.end - ppp_session.start) / 1000;
+
+	syslog.logf(LOG_INFO, "%s session ended after %lus: in %lu bytes "
+	    "(%lu/s), out %lu bytes (%lu/s)", link, secs,
+	    ppp_session.bytes_in, secs ? ppp_session.bytes_in / secs : 0,
+	    ppp_session.bytes_out, secs ? ppp_session.bytes_out / secs : 0);
+}
+
+/* and the link details, to tell noise from escaping from upstream */
+static void
+ppp_session_log(void)
+{
+	ppp_session_end("PPP");
+	syslog.logf(LOG_INFO, "PPP session frames: in %lu (%lu escapes, "
+	    "%lu FCS errors, %lu discarded), out %lu (%lu escapes, %lu "
+	    "dropped), echo RTT %lums avg %lums",
+	    hdlc_stats.rx_frames - ppp_session_hdlc.rx_frames,
+	    hdlc_stats.rx_escaped - ppp_session_hdlc.rx_escaped,
+	    hdlc_stats.rx_fcs_errors - ppp_session_hdlc.rx_fcs_errors,
+	    hdlc_stats.rx_discarded - ppp_session_hdlc.rx_discarded,
+	    hdlc_stats.tx_frames - ppp_session_hdlc.tx_frames,
+	    hdlc_stats.tx_escaped - ppp_session_hdlc.tx_escaped,
+	    (hdlc_stats.tx_dropped - ppp_session_hdlc.tx_dropped) +
+	    (hdlc_stats.codel_drops - ppp_session_hdlc.codel_drops),
+	    ppp_stats.echo_rtt, ppp_stats.echo_rtt_avg);
+}
+
+/* step the link MTU by the share of damaged frames from the client */
+static void
+ppp_mtu_adapt(void)
+{
+	unsigned long now = millis(), frames, errors;
+	uint16_t mtu = ppp_netif.mtu, next = mtu;
+	int i;
+
+	if (settings->ppp_mru || !ppp_session.mtu_negotiated ||
+	    now - ppp_mtu_last < PPP_MTU_WINDOW_MS)
+		return;
+
+	/*
+	 * Only count frames damaged on the line: bad FCS, aborted or
+	 * overlong.  Frames dropped for want of a pbuf are in rx_nomem.
+	 */
+	frames = hdlc_stats.rx_frames;
+	errors = hdlc_stats.rx_fcs_errors + hdlc_stats.rx_discarded;
+	if (frames < ppp_mtu_frames || errors < ppp_mtu_errors) {
+		/* AT$STATS! was used, start over */
+		ppp_mtu_frames = frames;
+		ppp_mtu_errors = errors;
+		return;
+	}
+
+	/* keep collecting until there's enough to go on */
+	frames -= ppp_mtu_frames;
+	errors -= ppp_mtu_errors;
+	if (frames + errors < PPP_MTU_MIN_FRAMES)
+		return;
+
+	ppp_mtu_last = now;
+	ppp_mtu_frames += frames;
+	ppp_mtu_errors += errors;
+
+	if (errors * 100 >= PPP_MTU_ERROR_PCT * (frames + errors)) {
+		ppp_mtu_clean = 0;
+		for (i = 0; i < (int)PPP_MTU_STEPS; i++) {
+			if (ppp_mtu_steps[i] < mtu) {
+				next = ppp_mtu_steps[i];
+				break;
+			}
+		}
+	} else if (errors == 0 && ++ppp_mtu_clean >= PPP_MTU_CLEAN_WINDOWS) {
+		ppp_mtu_clean = 0;
+		next = ppp_session.mtu_negotiated;
+		for (i = PPP_MTU_STEPS - 1; i >= 0; i--) {
+			if (ppp_mtu_steps[i] > mtu) {
+				if (ppp_mtu_steps[i] < next)
+					next = ppp_mtu_steps[i];
+				break;
+			}
+		}
+	}
+
+	if (next == mtu)
+		return;
 
-	serial_write(data, len);
+	syslog.logf(LOG_INFO, "PPP MTU %d -> %d, %lu of %lu frames damaged",
+	    mtu, next, errors, frames + errors);
+	ppp_netif.mtu = ppp_session.mtu = next;
+	ppp_stats.mtu_changes++;
+}
+
+/* RFC 1624 incremental update of the checksum at ck for a changed word */
+static void
+ppp_cksum_adjust(uint8_t *ck, uint16_t old, uint16_t now)
+{
+	uint32_t sum;
+
+	sum = (uint16_t)~((ck[0] << 8) | ck[1]) + (uint16_t)~old + now;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+	ck[0] = sum >> 8;
+	ck[1] = sum & 0xff;
+}
+
+/*
+ * Lower the MSS option of a TCP SYN crossing the PPP link in either
+ * direction, so neither end sends segments too big for the link, which
+ * would otherwise be fragmented or dropped.
+ */
+void
+ppp_clamp_mss(struct pbuf *p, uint16_t mtu)
+{
+	uint8_t *ip = (uint8_t *)p->payload, *tcp, *opt;
+	size_t ihl, thl, i;
+	uint16_t mss, max;
 
+	if (!settings->ppp_mss_clamp || mtu <= IP_HLEN + TCP_HLEN ||
+	    p->len < IP_HLEN || (ip[0] >> 4) != 4 || ip[9] != IP_PROTO_TCP)
+		return;
+
+	/* only the first fragment has a TCP header */
+	if ((ip[6] & 0x1f) || ip[7])
+		return;
+
+	ihl = (ip[0] & 0x0f) * 4;
+	if (ihl < IP_HLEN || p->len < ihl + TCP_HLEN)
+		return;
+
+	tcp = ip + ihl;
+	if (!(tcp[13] & TCP_SYN))
+		return;
+
+	thl = (tcp[12] >> 4) * 4;
+	if (thl < TCP_HLEN || p->len < ihl + thl)
+		return;
+
+	max = mtu - IP_HLEN - TCP_HLEN;
+
+	for (i = TCP_HLEN; i < thl; ) {
+		opt = tcp + i;
+		if (opt[0] == 0)
+			break;
+		if (opt[0] == 1) {
+			i++;
+			continue;
+		}
+		if (i + 2 > thl || opt[1] < 2 || i + opt[1] > thl)
+			break;
+
+		if (opt[0] == 2 && opt[1] == 4) {
+			mss = (opt[2] << 8) | opt[3];
+			if (mss <= max)
+				break;
+
+			opt[2] = max >> 8;
+			opt[3] = max & 0xff;
+
+			/* at an odd offset, the value straddles two words */
+			if ((i + 2) & 1)
+				ppp_cksum_adjust(tcp + 16,
+				    (mss >> 8) | (mss << 8),
+				    (max >> 8) | (max << 8));
+			else
+				ppp_cksum_adjust(tcp + 16, mss, max);
+
+			ppp_stats.mss_clamped++;
 #ifdef PPP_TRACE
-	long elap = millis();
-	syslog.logf(LOG_DEBUG, "forwarded %ld PPP bytes out in %ldms", len,
-	    elap - now);
+			syslog.logf(LOG_DEBUG, "clamped TCP MSS %d to %d", mss,
+			    max);
 #endif
+			break;
+		}
 
-	return len;
+		i += opt[1];
+	}
 }
 
 void
@@ -95,8 +550,9 @@ ppp_stop(bool wait)
 	if (wait) {
 		ppp_close(_ppp, 0);
 
-		while (state == STATE_PPP && now - millis() < 1000) {
-			pppos_input(_ppp, ppp_buf, 0);
+		while (state == STATE_PPP && millis() - now < 1000) {
+			hdlc_process();
+			serial_process();
 			yield();
 		}
 	}
@@ -108,7 +564,7 @@ ppp_stop(bool wait)
 void
 ppp_process(void)
 {
-	size_t bytes;
+	size_t bytes, total = 0;
 	long now = millis();
 
 	if (state != STATE_PPP) {
@@ -116,8 +572,13 @@ ppp_process(void)
 		return;
 	}
 
-	bytes = Serial.available();
-	if (!bytes) {
+	/* feed queued output to the ring as it drains */
+	hdlc_process();
+	ccp_process();
+	ppp_session_tick();
+	ppp_mtu_adapt();
+
+	if (!serial_available()) {
 		if (now - last_ppp_input > (1000 * PPP_TIMEOUT_SECS)) {
 			syslog.logf(LOG_WARNING, "no PPP input in %ld secs, "
 			    "hanging up", (now - last_ppp_input) / 1000);
@@ -128,15 +589,33 @@ ppp_process(void)
 	}
 
 	last_ppp_input = now;
-	if (bytes > PPP_BUF_SIZE)
-		bytes = PPP_BUF_SIZE;
 
-	bytes = Serial.readBytes(ppp_buf, bytes);
-	pppos_input(_ppp, ppp_buf, bytes);
+	/*
+	 * Keep feeding input to lwIP until the UART is empty or we've spent
+	 * AT$PPPBUDGET milliseconds, so the receive ring doesn't back up at
+	 * high baud rates.
+	 */
+	do {
+		bytes = serial_read(ppp_buf, sizeof(ppp_buf));
+		if (!bytes)
+			break;
+
+		hdlc_input(ppp_buf, bytes);
+		total += bytes;
+
+		/* push out any responses while we keep reading */
+		hdlc_process();
+		serial_process();
+	} while (millis() - now < settings->ppp_input_ms);
+
+	ppp_stats.input_passes++;
+	ppp_stats.input_bytes += total;
+	if (total > ppp_stats.input_pass_max)
+		ppp_stats.input_pass_max = total;
 
 #ifdef PPP_TRACE
 	long elap = millis();
-	syslog.logf(LOG_DEBUG, "processed %zu PPP input bytes in %ldms", bytes,
+	syslog.logf(LOG_DEBUG, "processed %zu PPP input bytes in %ldms", total,
 	    elap - now);
 #endif
 }
@@ -148,8 +627,19 @@ ppp_status_cb(ppp_pcb *pcb, int err, __attribute__((unused)) void *ctx)
 
 	switch (err) {
 	case PPPERR_NONE:
+		ppp_session.mtu = ppp_session.mtu_negotiated = nif->mtu;
+		ppp_mtu_last = millis();
+		ppp_mtu_frames = hdlc_stats.rx_frames;
+		ppp_mtu_errors = hdlc_stats.rx_fcs_errors +
+		    hdlc_stats.rx_discarded;
+		ppp_mtu_clean = 0;
+
+		ppp_stats.connect_ms = millis() - ppp_connect_time;
+		if (ppp_stats.connect_ms > ppp_stats.connect_ms_max)
+			ppp_stats.connect_ms_max = ppp_stats.connect_ms;
 		ppp_setup_nat(nif);
-		syslog.logf(LOG_DEBUG, "PPP session established, free mem %d",
+		syslog.logf(LOG_INFO, "PPP session established in %lums, "
+		    "MTU %d, free mem %d", ppp_stats.connect_ms, nif->mtu,
 		    ESP.getFreeHeap());
 		return;
 	case PPPERR_USER:
@@ -157,8 +647,9 @@ ppp_status_cb(ppp_pcb *pcb, int err, __attribute__((unused)) void *ctx)
 		syslog.log(LOG_DEBUG, "ending PPP session, "
 		    "returning to AT mode");
 #endif
-		ppp_free(_ppp);
-		_ppp = NULL;
+		ppp_stats_update();
+		ppp_session_log();
+		/* _ppp and its netif are kept for the next session */
 		state = STATE_AT;
 		serial_dcd(false);
 		outputf("\r\nNO CARRIER\r\n");
@@ -178,31 +669,49 @@ ppp_status_cb(ppp_pcb *pcb, int err, __attribute__((unused)) void *ctx)
 	}
 }
 
+/*
+ * NAPT is enabled once on each of the PPP and SLIP netifs, and the portmap
+ * is only redone when the WiFi or client address it points between has
+ * changed.
+ */
 void
 ppp_setup_nat(struct netif *nif)
 {
-	err_t ret = ip_napt_init(IP_NAPT_MAX, IP_PORTMAP_MAX);
-	if (ret == ERR_BUF) {
-		/* already initialized */
-	} else if (ret != ERR_OK) {
-		syslog.logf(LOG_ERR, "NAPT initialization failed (%d)",
-		    (int)ret);
+	static uint32_t napt_enabled = 0;
+	static uint32_t portmap_local = 0, portmap_client = 0;
+	uint32_t local, client;
+	err_t ret;
+
+	if (!nat_setup())
 		return;
+
+	if (!(napt_enabled & (1UL << nif->num))) {
+		ret = ip_napt_enable_no(nif->num, 1);
+		if (ret != ERR_OK) {
+			syslog.logf(LOG_INFO, "ip_napt_enable(%d) failed: %d",
+			    nif->num, (int)ret);
+			return;
+		}
+		napt_enabled |= (1UL << nif->num);
 	}
 
-	ret = ip_napt_enable_no(nif->num, 1);
-	if (ret != ERR_OK) {
-		syslog.logf(LOG_INFO, "ip_napt_enable(%d) failed: %d",
-		    nif->num, (int)ret);
+	local = WiFi.localIP();
+	client = ip_2_ip4(&nif->gw)->addr;
+	if (local == portmap_local && client == portmap_client)
 		return;
-	}
+
+	if (portmap_local)
+		ip_portmap_remove(IP_PROTO_TCP, 22);
+	portmap_local = portmap_client = 0;
 
 	/* forward port 22 on esp8266 to our client's PPP address */
-	ret = ip_portmap_add(IP_PROTO_TCP, WiFi.localIP(), 22,
-	    ip_2_ip4(&nif->gw)->addr, 22);
+	ret = ip_portmap_add(IP_PROTO_TCP, local, 22, client, 22);
 	if (ret != 1) {
 		syslog.logf(LOG_ERR, "failed setting up NAPT portmap: %d",
 		    (int)ret);
 		return;
 	}
+
+	portmap_local = local;
+	portmap_client = client;
 }
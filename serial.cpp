@@ -30,9 +30,85 @@ const unsigned long ok_bauds[] = {
 	38400,
 	57600,
 	115200,
+	230400,
+	460800,
+	921600,
 	0,
 };
 
+/*
+ * Outbound data waiting for the DTE to be ready.  HDLC only queues whole
+ * frames, so this must hold a maximum-size PPP frame with every byte
+ * escaped (address, control, protocol, MRU and FCS, plus two flags), or a
+ * frame full of control characters could never be sent.
+ */
+#define SERIAL_TX_BUF_SIZE	(2 * (4 + PPP_MRU + 2) + 2)
+static unsigned char serial_tx_buf[SERIAL_TX_BUF_SIZE];
+static size_t serial_tx_head = 0;
+static size_t serial_tx_tail = 0;
+static size_t serial_tx_len = 0;
+
+/*
+ * How long serial_write() and serial_flush() will wait on a DTE holding
+ * RTS down (or switched off) before giving up and discarding the output.
+ */
+#define SERIAL_RTS_TIMEOUT	(10 * 1000)
+
+/*
+ * Inbound data is buffered by the UART driver in a ring of this size, with
+ * CTS dropped once it fills past the high watermark and raised again when
+ * it drains below the low watermark.  The watermarks are only checked from
+ * loop(), so leave enough headroom above the high one for whatever arrives
+ * while we're busy elsewhere.
+ */
+#define SERIAL_RX_BUF_SIZE	2048
+#define SERIAL_RX_HIWAT		(SERIAL_RX_BUF_SIZE - 768)
+#define SERIAL_RX_LOWAT		(SERIAL_RX_BUF_SIZE / 4)
+static bool serial_cts_on = false;
+static bool serial_break_seen = false;
+
+/* in-band software flow control, when enabled with AT&I1 */
+static bool serial_tx_xoff = false;
+static bool serial_rx_xoff = false;
+
+/*
+ * Link counters, with per-second byte counts kept for the last minute so
+ * we can show current and average rates.
+ */
+struct serial_stats serial_stats = { 0 };
+#define SERIAL_STATS_SECS	60
+static unsigned long serial_stats_rx[SERIAL_STATS_SECS];
+static unsigned long serial_stats_tx[SERIAL_STATS_SECS];
+static unsigned int serial_stats_slot = 0;
+static unsigned int serial_stats_slots = 0;
+static unsigned long serial_stats_last_rx = 0;
+static unsigned long serial_stats_last_tx = 0;
+static unsigned long serial_stats_last_tick = 0;
+static unsigned long serial_rts_wait_since = 0;
+
+/*
+ * Auto-baud runs from serial_process() in two steps: the UART measures the
+ * shortest pulse it sees to guess a rate, then we switch to it and wait for
+ * an AT to confirm it, starting over if only garbage arrives.
+ */
+enum {
+	AUTOBAUD_IDLE = 0,
+	AUTOBAUD_DETECT,
+	AUTOBAUD_CONFIRM,
+};
+#define AUTOBAUD_TIMEOUT	(30 * 1000)
+#define AUTOBAUD_CONFIRM_TIMEOUT (5 * 1000)
+static uint8_t autobaud_state = AUTOBAUD_IDLE;
+static unsigned long autobaud_started = 0;
+static unsigned long autobaud_switched = 0;
+
+static void serial_autobaud_process(void);
+static void serial_stats_tick(void);
+static void serial_tx_drain(void);
+static void serial_rx_flow(void);
+static void serial_rx_xonxoff(void);
+static bool serial_tx_stalled(void);
+
 void
 serial_setup(void)
 {
@@ -60,7 +136,57 @@ serial_setup(void)
 void
 serial_start(int baud)
 {
+	Serial.setRxBufferSize(SERIAL_RX_BUF_SIZE);
 	Serial.begin(baud);
+
+	serial_tx_xoff = false;
+	serial_rx_xoff = false;
+}
+
+void
+serial_process(void)
+{
+	serial_autobaud_process();
+	serial_rx_flow();
+	serial_tx_drain();
+	serial_stats_tick();
+}
+
+size_t
+serial_tx_free(void)
+{
+	return SERIAL_TX_BUF_SIZE - serial_tx_len;
+}
+
+size_t
+serial_tx_queued(void)
+{
+	return serial_tx_len;
+}
+
+/*
+ * Queue as much of data as will fit in the transmit ring without blocking,
+ * returning the number of bytes queued.  serial_process() pushes it out to
+ * the UART as the DTE allows.
+ */
+size_t
+serial_queue(const unsigned char *data, size_t len)
+{
+	size_t n, chunk;
+
+	if (len > serial_tx_free())
+		len = serial_tx_free();
+
+	for (n = 0; n < len; n += chunk) {
+		chunk = len - n;
+		if (chunk > SERIAL_TX_BUF_SIZE - serial_tx_head)
+			chunk = SERIAL_TX_BUF_SIZE - serial_tx_head;
+		memcpy(serial_tx_buf + serial_tx_head, data + n, chunk);
+		serial_tx_head = (serial_tx_head + chunk) % SERIAL_TX_BUF_SIZE;
+	}
+	serial_tx_len += len;
+
+	return len;
 }
 
 void
@@ -69,93 +195,389 @@ serial_write(unsigned char b)
 	serial_write(&b, 1);
 }
 
+/*
+ * Queue all of data, only waiting on the UART if the transmit ring is
+ * completely full.  Keep watching for XON and CTS changes while waiting,
+ * since nothing else will until we return.
+ */
 void
 serial_write(unsigned char *data, size_t len)
 {
-	size_t i;
-	for (i = 0; i < len; i++) {
-		if (i % 8 == 0 && settings->reg_r == REG_R_RTS_ON) {
-			while (!serial_rts())
-				yield();
+	size_t wrote;
+
+	while (len) {
+		wrote = serial_queue(data, len);
+		data += wrote;
+		len -= wrote;
+
+		if (len) {
+			serial_rx_flow();
+			serial_tx_drain();
+			if (serial_tx_stalled())
+				return;
+			yield();
+		}
+	}
+}
+
+/*
+ * If the DTE has held RTS down for too long while we're waiting to send,
+ * throw away everything queued rather than waiting on it forever.
+ */
+static bool
+serial_tx_stalled(void)
+{
+	if (!serial_rts_wait_since ||
+	    millis() - serial_rts_wait_since < SERIAL_RTS_TIMEOUT)
+		return false;
+
+	syslog.logf(LOG_WARNING, "RTS down for %lums, discarding %u bytes "
+	    "of output", millis() - serial_rts_wait_since,
+	    (unsigned int)serial_tx_len);
+
+	serial_tx_head = serial_tx_tail = serial_tx_len = 0;
+	return true;
+}
+
+/* push out as much of the transmit ring as the UART will take right now */
+static void
+serial_tx_drain(void)
+{
+	size_t chunk, room;
+
+	while (serial_tx_len) {
+		if (settings->reg_r == REG_R_RTS_ON && !serial_rts()) {
+			if (!serial_rts_wait_since)
+				serial_rts_wait_since = millis();
+			return;
+		}
+		if (serial_rts_wait_since) {
+			serial_stats.rts_wait_ms += millis() -
+			    serial_rts_wait_since;
+			serial_rts_wait_since = 0;
+		}
+		if (serial_tx_xoff)
+			return;
+
+		room = Serial.availableForWrite();
+		if (room == 0)
+			return;
+
+		chunk = serial_tx_len;
+		if (chunk > SERIAL_TX_BUF_SIZE - serial_tx_tail)
+			chunk = SERIAL_TX_BUF_SIZE - serial_tx_tail;
+		if (chunk > room)
+			chunk = room;
+
+		chunk = Serial.write(serial_tx_buf + serial_tx_tail, chunk);
+		serial_stats.tx_bytes += chunk;
+		serial_tx_tail = (serial_tx_tail + chunk) % SERIAL_TX_BUF_SIZE;
+		serial_tx_len -= chunk;
+	}
+}
+
+/* manage CTS and XON/XOFF based on how full the receive ring is */
+static void
+serial_rx_flow(void)
+{
+	size_t avail;
+
+	if (Serial.hasOverrun()) {
+		serial_stats.rx_overruns++;
+		syslog.logf(LOG_WARNING, "serial receive overrun (%lu total)",
+		    serial_stats.rx_overruns);
+	}
+
+	if (Serial.hasRxError()) {
+		serial_stats.rx_errors++;
+
+		/*
+		 * A BREAK shows up as a NUL with a framing error, so if that's
+		 * all that arrived on an otherwise idle line, take it as one.
+		 */
+		if (Serial.available() == 1 && Serial.peek() == 0) {
+			Serial.read();
+			serial_break_seen = true;
 		}
-		Serial.write(data[i]);
 	}
+
+	serial_rx_xonxoff();
+	avail = Serial.available();
+	if (avail > serial_stats.rx_peak)
+		serial_stats.rx_peak = avail;
+
+	if (settings->reg_i == REG_I_XONXOFF_ON) {
+		/* these go out ahead of anything in the transmit ring */
+		if (!serial_rx_xoff && avail >= SERIAL_RX_HIWAT) {
+			Serial.write(XOFF);
+			serial_stats.tx_bytes++;
+			serial_rx_xoff = true;
+		} else if (serial_rx_xoff && avail <= SERIAL_RX_LOWAT) {
+			Serial.write(XON);
+			serial_stats.tx_bytes++;
+			serial_rx_xoff = false;
+		}
+	} else {
+		serial_tx_xoff = false;
+		serial_rx_xoff = false;
+	}
+
+	if (settings->reg_r != REG_R_RTS_ON) {
+		if (!serial_cts_on)
+			serial_cts(true);
+		return;
+	}
+
+	if (serial_cts_on && avail >= SERIAL_RX_HIWAT)
+		serial_cts(false);
+	else if (!serial_cts_on && avail <= SERIAL_RX_LOWAT)
+		serial_cts(true);
+}
+
+/*
+ * Consume any XON/XOFF characters at the head of the receive ring, pausing
+ * or resuming our transmit ring accordingly.  Once software flow control is
+ * on, these never make it through to AT, telnet, or PPP processing.
+ */
+static void
+serial_rx_xonxoff(void)
+{
+	int c;
+
+	if (settings->reg_i != REG_I_XONXOFF_ON)
+		return;
+
+	while ((c = Serial.peek()) == XON || c == XOFF) {
+		Serial.read();
+		serial_stats.rx_bytes++;
+		serial_tx_xoff = (c == XOFF);
+	}
+}
+
+/* roll the per-second byte counts and recompute rates */
+static void
+serial_stats_tick(void)
+{
+	unsigned long now = millis(), rx = 0, tx = 0;
+	unsigned int i;
+
+	if (now - serial_stats_last_tick < 1000)
+		return;
+	serial_stats_last_tick = now;
+
+	serial_stats_rx[serial_stats_slot] = serial_stats.rx_bytes -
+	    serial_stats_last_rx;
+	serial_stats_tx[serial_stats_slot] = serial_stats.tx_bytes -
+	    serial_stats_last_tx;
+	serial_stats_last_rx = serial_stats.rx_bytes;
+	serial_stats_last_tx = serial_stats.tx_bytes;
+
+	serial_stats.rx_rate = serial_stats_rx[serial_stats_slot];
+	serial_stats.tx_rate = serial_stats_tx[serial_stats_slot];
+
+	serial_stats_slot = (serial_stats_slot + 1) % SERIAL_STATS_SECS;
+	if (serial_stats_slots < SERIAL_STATS_SECS)
+		serial_stats_slots++;
+
+	for (i = 0; i < serial_stats_slots; i++) {
+		rx += serial_stats_rx[i];
+		tx += serial_stats_tx[i];
+	}
+	serial_stats.rx_rate_avg = rx / serial_stats_slots;
+	serial_stats.tx_rate_avg = tx / serial_stats_slots;
 }
 
+void
+serial_stats_reset(void)
+{
+	memset(&serial_stats, 0, sizeof(serial_stats));
+	serial_stats.since = millis();
+
+	serial_stats_slot = 0;
+	serial_stats_slots = 0;
+	serial_stats_last_rx = 0;
+	serial_stats_last_tx = 0;
+	if (serial_rts_wait_since)
+		serial_rts_wait_since = millis();
+}
+
+/* wait for everything queued to actually go out over the wire */
 void
 serial_flush(void)
 {
+	while (serial_tx_len) {
+		/* an XON can only get through if we're looking for it */
+		serial_rx_flow();
+		serial_tx_drain();
+		if (serial_tx_stalled())
+			return;
+		yield();
+	}
+
 	Serial.flush();
 }
 
-bool
+size_t
 serial_available(void)
 {
+	/* anything read while detecting is at the wrong rate */
+	if (autobaud_state == AUTOBAUD_DETECT)
+		return 0;
+
+	serial_rx_xonxoff();
 	return Serial.available();
 }
 
 uint8_t
 serial_read(void)
 {
-	return Serial.read();
+	int c;
+
+	serial_rx_xonxoff();
+	if ((c = Serial.read()) != -1)
+		serial_stats.rx_bytes++;
+
+	return c;
+}
+
+/* read up to len bytes without blocking, returning the number read */
+size_t
+serial_read(unsigned char *buf, size_t len)
+{
+	size_t i, j;
+
+	len = Serial.read((char *)buf, len);
+	serial_stats.rx_bytes += len;
+
+	if (settings->reg_i != REG_I_XONXOFF_ON)
+		return len;
+
+	for (i = 0, j = 0; i < len; i++) {
+		if (buf[i] == XON || buf[i] == XOFF) {
+			serial_tx_xoff = (buf[i] == XOFF);
+			continue;
+		}
+		buf[j++] = buf[i];
+	}
+
+	return j;
 }
 
 int16_t
 serial_peek(void)
 {
+	serial_rx_xonxoff();
 	return Serial.peek();
 }
 
-long
-serial_autobaud(void)
+bool
+serial_baud_ok(unsigned long baud)
 {
-	unsigned long abaud, baud = 0;
 	int i;
 
-	Serial.begin(115200);
-
-	abaud = Serial.detectBaudrate(30000);
-	if (abaud) {
-		for (i = 0; ; i++) {
-			if (ok_bauds[i] == 0)
-				break;
-			else if (ok_bauds[i] == abaud) {
-				baud = abaud;
-				break;
-			}
+	for (i = 0; ok_bauds[i] != 0; i++) {
+		if (ok_bauds[i] == baud)
+			return true;
+	}
+
+	return false;
+}
+
+/* whether the DTE has sent a BREAK since we last checked */
+bool
+serial_break(void)
+{
+	bool ret = serial_break_seen;
+
+	serial_break_seen = false;
+	return ret;
+}
+
+/* start auto-detecting the DTE's baud rate, see serial_autobaud_process() */
+void
+serial_autobaud(void)
+{
+	autobaud_state = AUTOBAUD_DETECT;
+	autobaud_started = millis();
+
+	/* prime the UART's pulse measurement */
+	Serial.testBaudrate();
+}
+
+/* called from AT processing when an AT, or garbage, has been received */
+void
+serial_autobaud_confirm(bool ok)
+{
+	if (autobaud_state != AUTOBAUD_CONFIRM)
+		return;
+
+	if (ok) {
+		syslog.logf(LOG_INFO, "confirmed baud rate of %d",
+		    Serial.baudRate());
+		autobaud_state = AUTOBAUD_IDLE;
+		return;
+	}
+
+	syslog.logf(LOG_INFO, "received garbage at %d, re-detecting baud "
+	    "rate", Serial.baudRate());
+	autobaud_state = AUTOBAUD_DETECT;
+	Serial.testBaudrate();
+}
+
+static void
+serial_autobaud_process(void)
+{
+	unsigned long baud, now = millis();
+
+	switch (autobaud_state) {
+	case AUTOBAUD_DETECT:
+		while (Serial.available())
+			Serial.read();
+
+		if (now - autobaud_started > AUTOBAUD_TIMEOUT) {
+			syslog.logf(LOG_INFO, "couldn't auto-detect baud rate, "
+			    "using %d", settings->baud);
+			serial_start(settings->baud);
+			autobaud_state = AUTOBAUD_IDLE;
+			break;
 		}
 
-		if (baud)
-			syslog.logf(LOG_INFO, "auto-detected baud rate of %lu",
-			    baud);
-		else {
+		baud = Serial.testBaudrate();
+		if (!baud)
+			break;
+
+		if (!serial_baud_ok(baud)) {
 			syslog.logf(LOG_INFO, "auto-detected bogus baud %lu, "
-			    "using %d", abaud, settings->baud);
-			baud = settings->baud;
+			    "still trying", baud);
+			break;
 		}
-	} else {
-		syslog.logf(LOG_INFO, "couldn't auto-detect baud rate, "
-		    "using %d", settings->baud);
-		baud = settings->baud;
-	}
 
-	Serial.begin(baud);
+		syslog.logf(LOG_INFO, "auto-detected baud rate of %lu", baud);
+		serial_start(baud);
+		autobaud_state = AUTOBAUD_CONFIRM;
+		autobaud_switched = now;
 
-	/* terminal program will probably look for an AT */
-	if (!settings->quiet) {
-		if (settings->verbal)
-			output("\r\nOK\r\n");
-		else
-			output("\r0\r");
+		/* terminal program will probably look for an AT */
+		if (!settings->quiet) {
+			if (settings->verbal)
+				output("\r\nOK\r\n");
+			else
+				output("\r0\r");
+		}
+		break;
+	case AUTOBAUD_CONFIRM:
+		/* no garbage in a while, assume we got it right */
+		if (now - autobaud_switched > AUTOBAUD_CONFIRM_TIMEOUT)
+			autobaud_state = AUTOBAUD_IDLE;
+		break;
 	}
-
-	return baud;
 }
 
 /* Clear to Send */
 void
 serial_cts(bool clear)
 {
+	serial_cts_on = clear;
 	digitalWrite(pCTS, clear ? LOW : HIGH); /* inverted */
 }
 
@@ -0,0 +1,472 @@
+/*
+ * WiFiPPP
+ * Copyright (c) 2021 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * SLIP (RFC 1055) and CSLIP (RFC 1144) for clients too old or too small
+ * for PPP.  There is nothing to negotiate, so the client just has to be
+ * configured with the addresses we would have given it over IPCP, and
+ * the link comes up as soon as we answer.
+ *
+ * lwIP's slipif needs a sio layer and isn't built into the core, so this
+ * is its own netif, using the VJ code from lwIP's PPP for CSLIP.
+ */
+
+#include <lwip/ip.h>
+#include <lwip/netif.h>
+#include <lwip/pbuf.h>
+#include <netif/ppp/ppp_impl.h>
+#if VJ_SUPPORT
+#include <netif/ppp/vj.h>
+#endif
+
+#include "wifippp.h"
+
+#define SLIP_END		0300
+#define SLIP_ESC		0333
+#define SLIP_ESC_END		0334
+#define SLIP_ESC_ESC		0335
+
+/* RFC 1144 packet types, in the top bits of a CSLIP packet's first byte */
+#define SLIP_TYPE_IP			0x40
+#define SLIP_TYPE_UNCOMPRESSED_TCP	0x70
+#define SLIP_TYPE_COMPRESSED_TCP	0x80
+
+/* the traditional SLIP MTU, which clients are usually configured with */
+#define SLIP_MTU		1006
+
+/* room to put back a CSLIP header in front of what we received */
+#define SLIP_VJ_HEADROOM	128
+
+#define SLIP_BUF_SIZE		512
+#define SLIP_TX_CHUNK		128
+#define SLIP_Q_SLOTS		16
+#define SLIP_Q_BYTES		(4 * SLIP_MTU)
+
+#define SLIP_TIMEOUT_SECS	(60 * 10)
+
+struct slip_stats slip_stats = { 0 };
+
+static struct netif slip_netif;
+static bool slip_netif_added = false;
+static bool slip_open = false;
+static bool slip_cslip = false;
+#if VJ_SUPPORT
+static struct vjcompress slip_vj;
+#endif
+
+static uint8_t slip_buf[SLIP_BUF_SIZE];
+static uint8_t slip_rx_buf[SLIP_MTU];
+static size_t slip_rx_len = 0;
+static bool slip_rx_esc = false;
+static bool slip_rx_error = false;
+static long slip_last_input = 0;
+
+/* packets waiting for room in the transmit ring */
+static struct pbuf *slip_q[SLIP_Q_SLOTS];
+static unsigned int slip_q_head = 0, slip_q_count = 0;
+static size_t slip_q_bytes = 0;
+
+static err_t slip_netif_init(struct netif *);
+static err_t slip_output(struct netif *, struct pbuf *, const ip4_addr_t *);
+
+static void
+slip_q_flush(void)
+{
+	while (slip_q_count) {
+		slip_q_bytes -= slip_q[slip_q_head]->tot_len;
+		pbuf_free(slip_q[slip_q_head]);
+		slip_q_head = (slip_q_head + 1) % SLIP_Q_SLOTS;
+		slip_q_count--;
+	}
+}
+
+bool
+slip_start(bool cslip)
+{
+	ip4_addr_t s_addr, c_addr, mask;
+
+#if !VJ_SUPPORT
+	if (cslip) {
+		syslog.log(LOG_ERR, "CSLIP needs VJ_SUPPORT");
+		return false;
+	}
+#endif
+
+	ip_addr_copy(s_addr, settings->ppp_server_ip);
+	ip_addr_copy(c_addr, settings->ppp_client_ip);
+	IP4_ADDR(&mask, 255, 255, 255, 255);
+
+	/* like PPP's, the netif is kept around between calls */
+	if (!slip_netif_added) {
+		if (netif_add(&slip_netif, &s_addr, &mask, &c_addr, NULL,
+		    slip_netif_init, ip_input) == NULL) {
+			syslog.log(LOG_ERR, "SLIP netif_add failed");
+			return false;
+		}
+		slip_netif_added = true;
+	} else
+		netif_set_addr(&slip_netif, &s_addr, &mask, &c_addr);
+
+	slip_cslip = cslip;
+#if VJ_SUPPORT
+	vj_compress_init(&slip_vj);
+#endif
+	slip_rx_len = 0;
+	slip_rx_esc = false;
+	slip_rx_error = false;
+	slip_q_flush();
+
+	outputf("CONNECT %d %s:%s\r\n", Serial.baudRate(),
+	    ipaddr_ntoa(&s_addr), cslip ? "CSLIP" : "SLIP");
+	/* there's no IPCP, so tell anyone reading where to point the client */
+	if (settings->verbal)
+		outputf("Your IP address is %s. MTU is %d bytes.\r\n",
+		    ipaddr_ntoa(&c_addr), SLIP_MTU);
+	serial_dcd(true);
+
+	ppp_session_begin();
+	slip_last_input = millis();
+
+	netif_set_link_up(&slip_netif);
+	netif_set_up(&slip_netif);
+	slip_open = true;
+
+	ppp_setup_nat(&slip_netif);
+
+	syslog.logf(LOG_INFO, "%s session established, free mem %d",
+	    cslip ? "CSLIP" : "SLIP", ESP.getFreeHeap());
+
+	return true;
+}
+
+void
+slip_stop(void)
+{
+	if (!slip_open)
+		return;
+
+	slip_open = false;
+	netif_set_down(&slip_netif);
+	netif_set_link_down(&slip_netif);
+	slip_q_flush();
+
+	ppp_session_end(slip_cslip ? "CSLIP" : "SLIP");
+
+	state = STATE_AT;
+	serial_dcd(false);
+	outputf("\r\nNO CARRIER\r\n");
+}
+
+static err_t
+slip_netif_init(struct netif *nif)
+{
+	nif->name[0] = 's';
+	nif->name[1] = 'l';
+	nif->output = slip_output;
+	nif->mtu = SLIP_MTU;
+	nif->flags = 0;
+
+	return ERR_OK;
+}
+
+/* hand a complete packet from the client to lwIP */
+static void
+slip_packet(uint8_t *pkt, size_t len)
+{
+	struct pbuf *p;
+	int type = SLIP_TYPE_IP;
+
+	if (len < 1)
+		return;
+
+	if (slip_cslip) {
+		if (pkt[0] & SLIP_TYPE_COMPRESSED_TCP) {
+			type = SLIP_TYPE_COMPRESSED_TCP;
+			pkt[0] &= ~SLIP_TYPE_COMPRESSED_TCP;
+		} else if (pkt[0] >= SLIP_TYPE_UNCOMPRESSED_TCP) {
+			type = SLIP_TYPE_UNCOMPRESSED_TCP;
+			pkt[0] &= 0x4f;
+		}
+	}
+
+	if (type == SLIP_TYPE_IP && (len < IP_HLEN || (pkt[0] >> 4) != 4)) {
+		slip_stats.rx_errors++;
+		return;
+	}
+
+	p = pbuf_alloc((pbuf_layer)(PBUF_LINK + SLIP_VJ_HEADROOM), len,
+	    PBUF_RAM);
+	if (p == NULL) {
+		slip_stats.rx_dropped++;
+		return;
+	}
+	memcpy(p->payload, pkt, len);
+
+#if VJ_SUPPORT
+	if (type == SLIP_TYPE_COMPRESSED_TCP) {
+		if (vj_uncompress_tcp(&p, &slip_vj) < 0) {
+			slip_stats.rx_errors++;
+			pbuf_free(p);
+			return;
+		}
+		slip_stats.rx_compressed++;
+	} else if (type == SLIP_TYPE_UNCOMPRESSED_TCP) {
+		if (vj_uncompress_uncomp(p, &slip_vj) < 0) {
+			slip_stats.rx_errors++;
+			pbuf_free(p);
+			return;
+		}
+	}
+
+	/*
+	 * If the VJ code had to put the header in a pbuf of its own, there
+	 * is no room left for the Ethernet header when NAPT forwards it.
+	 */
+	if (p->next != NULL) {
+		struct pbuf *np = pbuf_alloc(PBUF_LINK, p->tot_len, PBUF_RAM);
+		if (np == NULL || pbuf_copy(np, p) != ERR_OK) {
+			if (np)
+				pbuf_free(np);
+			pbuf_free(p);
+			slip_stats.rx_dropped++;
+			return;
+		}
+		pbuf_free(p);
+		p = np;
+	}
+#endif
+
+	slip_stats.rx_packets++;
+	ppp_clamp_mss(p, slip_netif.mtu);
+	ppp_account(true, PPP_IP, p);
+
+	if (slip_netif.input(p, &slip_netif) != ERR_OK)
+		pbuf_free(p);
+}
+
+static void
+slip_input(const uint8_t *data, size_t len)
+{
+	uint8_t c;
+
+	slip_stats.rx_bytes += len;
+
+	while (len--) {
+		c = *data++;
+
+		if (c == SLIP_END) {
+			if (slip_rx_error) {
+#if VJ_SUPPORT
+				/* VJ state can't be trusted after a loss */
+				if (slip_cslip)
+					vj_uncompress_err(&slip_vj);
+#endif
+			} else if (slip_rx_len)
+				slip_packet(slip_rx_buf, slip_rx_len);
+			slip_rx_len = 0;
+			slip_rx_esc = false;
+			slip_rx_error = false;
+			continue;
+		}
+
+		if (slip_rx_error)
+			continue;
+
+		if (slip_rx_esc) {
+			slip_rx_esc = false;
+			if (c == SLIP_ESC_END)
+				c = SLIP_END;
+			else if (c == SLIP_ESC_ESC)
+				c = SLIP_ESC;
+			else {
+				/* a protocol violation, so the packet is bad */
+				slip_stats.rx_errors++;
+				slip_rx_error = true;
+				continue;
+			}
+		} else if (c == SLIP_ESC) {
+			slip_rx_esc = true;
+			continue;
+		}
+
+		if (slip_rx_len >= sizeof(slip_rx_buf)) {
+			slip_stats.rx_errors++;
+			slip_rx_error = true;
+			continue;
+		}
+		slip_rx_buf[slip_rx_len++] = c;
+	}
+}
+
+/*
+ * Put a packet in the transmit ring, framed by ENDs on both sides so any
+ * line noise before it ends up in a packet of its own that gets dropped.
+ */
+static bool
+slip_send(struct pbuf *pb)
+{
+	uint8_t buf[SLIP_TX_CHUNK * 2];
+	const uint8_t *data;
+	struct pbuf *q;
+	size_t need, i, blen;
+
+	need = 2 + pb->tot_len;
+	for (q = pb; q != NULL; q = q->next) {
+		data = (const uint8_t *)q->payload;
+		for (i = 0; i < q->len; i++)
+			if (data[i] == SLIP_END || data[i] == SLIP_ESC)
+				need++;
+	}
+
+	if (serial_tx_free() < need)
+		return false;
+
+	buf[0] = SLIP_END;
+	blen = 1;
+	for (q = pb; q != NULL; q = q->next) {
+		data = (const uint8_t *)q->payload;
+		for (i = 0; i < q->len; i++) {
+			if (blen >= sizeof(buf) - 2) {
+				serial_queue(buf, blen);
+				blen = 0;
+			}
+			if (data[i] == SLIP_END) {
+				buf[blen++] = SLIP_ESC;
+				buf[blen++] = SLIP_ESC_END;
+			} else if (data[i] == SLIP_ESC) {
+				buf[blen++] = SLIP_ESC;
+				buf[blen++] = SLIP_ESC_ESC;
+			} else
+				buf[blen++] = data[i];
+		}
+	}
+	buf[blen++] = SLIP_END;
+	serial_queue(buf, blen);
+
+	slip_stats.tx_packets++;
+	slip_stats.tx_bytes += need;
+
+	return true;
+}
+
+static void
+slip_q_process(void)
+{
+	struct pbuf *p;
+
+	while (slip_q_count) {
+		p = slip_q[slip_q_head];
+		if (!slip_send(p))
+			return;
+
+		slip_q_bytes -= p->tot_len;
+		pbuf_free(p);
+		slip_q_head = (slip_q_head + 1) % SLIP_Q_SLOTS;
+		slip_q_count--;
+	}
+}
+
+static err_t
+slip_output(__attribute__((unused)) struct netif *nif, struct pbuf *pb,
+    __attribute__((unused)) const ip4_addr_t *ipaddr)
+{
+	struct pbuf *p;
+#if VJ_SUPPORT
+	uint8_t type;
+#endif
+
+	if (!slip_open)
+		return ERR_IF;
+
+	if (slip_q_count == SLIP_Q_SLOTS ||
+	    slip_q_bytes + pb->tot_len > SLIP_Q_BYTES) {
+		slip_stats.tx_dropped++;
+		return ERR_MEM;
+	}
+
+	/*
+	 * pb is still the caller's (and may be a TCP segment kept for
+	 * retransmission), and both MSS clamping and VJ rewrite headers in
+	 * place, so queue a copy of our own.
+	 */
+	p = pbuf_clone(PBUF_RAW, PBUF_RAM, pb);
+	if (p == NULL) {
+		slip_stats.tx_dropped++;
+		return ERR_MEM;
+	}
+
+	ppp_clamp_mss(p, slip_netif.mtu);
+	ppp_account(false, PPP_IP, p);
+
+#if VJ_SUPPORT
+	if (slip_cslip && p->len >= IP_HLEN &&
+	    ((uint8_t *)p->payload)[9] == IP_PROTO_TCP) {
+		type = vj_compress_tcp(&slip_vj, &p);
+		/* lwIP's types are the same values RFC 1144 puts on the wire */
+		if (type == TYPE_COMPRESSED_TCP)
+			slip_stats.tx_compressed++;
+		if (type != TYPE_IP)
+			*(uint8_t *)p->payload |= type;
+	}
+#endif
+
+	slip_q[(slip_q_head + slip_q_count) % SLIP_Q_SLOTS] = p;
+	slip_q_count++;
+	slip_q_bytes += p->tot_len;
+
+	slip_q_process();
+
+	return ERR_OK;
+}
+
+void
+slip_process(void)
+{
+	size_t bytes;
+	long now = millis();
+
+	if (state != STATE_SLIP) {
+		syslog.logf(LOG_ERR, "%s but state is %d!", __func__, state);
+		return;
+	}
+
+	slip_q_process();
+	ppp_session_tick();
+
+	if (!serial_available()) {
+		if (now - slip_last_input > (1000 * SLIP_TIMEOUT_SECS)) {
+			syslog.logf(LOG_WARNING, "no SLIP input in %ld secs, "
+			    "hanging up", (now - slip_last_input) / 1000);
+			slip_stop();
+		}
+		return;
+	}
+
+	slip_last_input = now;
+
+	do {
+		bytes = serial_read(slip_buf, sizeof(slip_buf));
+		if (!bytes)
+			break;
+
+		slip_input(slip_buf, bytes);
+
+		/* push out any responses while we keep reading */
+		slip_q_process();
+		serial_process();
+	} while (millis() - now < settings->ppp_input_ms);
+}
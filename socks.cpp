@@ -24,58 +24,276 @@
 
 WiFiServer socks_server(SOCKS_PORT);
 
-#define MAX_SOCKS_CLIENTS 5
-static SocksClient *socks_clients[MAX_SOCKS_CLIENTS] = { nullptr };
+/*
+ * Sessions come from a pool allocated once at startup, sized from free heap,
+ * so they aren't fragmenting the heap with new/delete all day.  Connections
+ * accepted while every session is busy (or heap is short) wait in a small
+ * queue and are handed to sessions as they free up.
+ */
+
+/* rough heap used by an active plain session: buffers, pcb, pbufs */
+#define SOCKS_SESSION_MEM	3072
+#define SOCKS_MIN_SESSIONS	4
+#define SOCKS_MAX_SESSIONS	12
+/* don't start a new session with less than this free, TLS needs a lot */
+#define SOCKS_MIN_FREE		(8 * 1024)
+
+#define SOCKS_QUEUE_LEN		8
+#define SOCKS_QUEUE_TIMEOUT	(30 * 1000)
+
+/*
+ * Hostnames requested through the proxy and what they resolved to.  lwIP's
+ * resolver doesn't tell us the record's TTL, so keep answers only briefly,
+ * so that short-TTL names still move when their records do.  Past that,
+ * lwIP's own table, which does honor the TTL, usually answers anyway.
+ */
+#define SOCKS_CACHE_SLOTS	16
+#define SOCKS_CACHE_TTL		60
+#define SOCKS_CACHE_NEG_TTL	30
+/* longer names are resolved every time rather than cached */
+#define SOCKS_CACHE_HOST_MAX	63
+
+struct socks_cache_entry {
+	char host[SOCKS_CACHE_HOST_MAX + 1];
+	ip4_addr_t ip;		/* zero if it didn't resolve */
+	unsigned long added;
+	unsigned long ttl;
+	unsigned long used;
+};
+
+struct socks_stats socks_stats = { 0 };
+
+static SocksClient *socks_clients = nullptr;
+static int socks_nclients = 0;
+
+static struct {
+	WiFiClient client;
+	unsigned long queued;
+} socks_queue[SOCKS_QUEUE_LEN];
+static int socks_queue_head = 0;
+static int socks_queue_len = 0;
+
+static struct socks_cache_entry socks_cache[SOCKS_CACHE_SLOTS];
 
 void
 socks_setup(void)
 {
 	socks_server = WiFiServer(settings->ppp_server_ip, SOCKS_PORT);
 	socks_server.begin();
+
+	/* re-binding to a new server IP keeps the pool */
+	if (socks_clients)
+		return;
+
+	/* leave half of free heap for everything else */
+	socks_nclients = (ESP.getFreeHeap() / 2) / SOCKS_SESSION_MEM;
+	if (socks_nclients < SOCKS_MIN_SESSIONS)
+		socks_nclients = SOCKS_MIN_SESSIONS;
+	if (socks_nclients > SOCKS_MAX_SESSIONS)
+		socks_nclients = SOCKS_MAX_SESSIONS;
+
+	socks_clients = new SocksClient[socks_nclients];
+
+	syslog.logf(LOG_INFO, "SOCKS pool of %d sessions, free mem %d",
+	    socks_nclients, ESP.getFreeHeap());
+}
+
+static void
+socks_dequeue(void)
+{
+	socks_queue[socks_queue_head].client = WiFiClient();
+	socks_queue_head = (socks_queue_head + 1) % SOCKS_QUEUE_LEN;
+	socks_queue_len--;
 }
 
 void
 socks_process(void)
 {
-	int i;
+	int i, n;
 
-	if (socks_server.hasClient()) {
-		int slot = -1;
+	/* accept new connections while there's room to queue them */
+	while (socks_queue_len < SOCKS_QUEUE_LEN && socks_server.hasClient()) {
+		WiFiClient client = socks_server.available();
 
-		for (i = 0; i < MAX_SOCKS_CLIENTS; i++) {
-			if (!socks_clients[i] || socks_clients[i]->done()) {
-				if (socks_clients[i])
-					delete socks_clients[i];
-				slot = i;
-				break;
-			}
-		}
+		if (!client.connected())
+			continue;
+
+		n = (socks_queue_head + socks_queue_len) % SOCKS_QUEUE_LEN;
+		socks_queue[n].client = client;
+		socks_queue[n].queued = millis();
+		socks_queue_len++;
+	}
+
+	/* run sessions, reclaiming each as soon as it finishes */
+	for (i = 0; i < socks_nclients; i++) {
+		if (socks_clients[i].done())
+			continue;
+
+		socks_clients[i].process();
 
+		if (socks_clients[i].done())
+			socks_clients[i].reset();
+	}
+
+	/* drop queued connections that went away or waited too long */
+	while (socks_queue_len) {
+		n = socks_queue_head;
+		if (socks_queue[n].client.connected() &&
+		    millis() - socks_queue[n].queued < SOCKS_QUEUE_TIMEOUT)
+			break;
+
+		syslog.logf(LOG_WARNING, "dropping queued SOCKS connection "
+		    "after %lums", millis() - socks_queue[n].queued);
+		socks_queue[n].client.stop();
+		socks_dequeue();
+		socks_stats.queue_drops++;
+	}
+
+	/* and hand the rest to free sessions */
+	for (i = 0; i < socks_nclients && socks_queue_len; i++) {
+		if (!socks_clients[i].done())
+			continue;
+
+		if (ESP.getFreeHeap() < SOCKS_MIN_FREE)
+			break;
+
+		n = socks_queue_head;
 #ifdef SOCKS_TRACE
-		syslog.logf(LOG_DEBUG, "new SOCKS client, slot %d", slot);
+		syslog.logf(LOG_DEBUG, "new SOCKS client, slot %d, waited "
+		    "%lums", i, millis() - socks_queue[n].queued);
 #endif
 
-		if (slot > -1) {
-			WiFiClient client = socks_server.available();
-			if (client.connected())
-				socks_clients[slot] = new SocksClient(slot,
-				    client);
-			else
-				syslog.logf(LOG_ERR, "found slot %d for new "
-				    "connection but not connected", slot);
-		}
+		socks_clients[i].begin(i, socks_queue[n].client);
+		socks_dequeue();
+		socks_stats.sessions++;
 	}
+}
+
+static bool
+socks_cache_expired(struct socks_cache_entry *e, unsigned long now)
+{
+	return ((now - e->added) / 1000 >= e->ttl);
+}
+
+/*
+ * Look up a hostname in the cache, returning true if it's there.  A zero
+ * address means it's cached as not resolving.
+ */
+bool
+socks_cache_lookup(const char *host, ip4_addr_t *ip)
+{
+	struct socks_cache_entry *e;
+	unsigned long now = millis();
+	int i;
 
-	for (i = 0; i < MAX_SOCKS_CLIENTS; i++) {
-		if (!socks_clients[i])
+	if (strlen(host) > SOCKS_CACHE_HOST_MAX)
+		return false;
+
+	for (i = 0; i < SOCKS_CACHE_SLOTS; i++) {
+		e = &socks_cache[i];
+		if (e->host[0] == '\0' || strcasecmp(e->host, host) != 0)
 			continue;
 
-		if (socks_clients[i]->done()) {
-			delete socks_clients[i];
-			socks_clients[i] = nullptr;
+		if (socks_cache_expired(e, now)) {
+			e->host[0] = '\0';
+			break;
+		}
+
+		e->used = now;
+		ip4_addr_copy(*ip, e->ip);
+		if (ip4_addr_isany_val(e->ip))
+			socks_stats.cache_negative_hits++;
+		else
+			socks_stats.cache_hits++;
+		return true;
+	}
+
+	socks_stats.cache_misses++;
+	return false;
+}
+
+void
+socks_cache_store(const char *host, const ip4_addr_t *ip)
+{
+	struct socks_cache_entry *e = NULL, *free_e = NULL, *lru_e = NULL;
+	unsigned long now = millis();
+	int i;
+
+	if (strlen(host) > SOCKS_CACHE_HOST_MAX)
+		return;
+
+	for (i = 0; i < SOCKS_CACHE_SLOTS; i++) {
+		e = &socks_cache[i];
+		if (e->host[0] != '\0' && socks_cache_expired(e, now))
+			e->host[0] = '\0';
+
+		if (e->host[0] == '\0') {
+			if (free_e == NULL)
+				free_e = e;
 			continue;
 		}
 
-		socks_clients[i]->process();
+		if (strcasecmp(e->host, host) == 0)
+			break;
+
+		if (lru_e == NULL || (long)(e->used - lru_e->used) < 0)
+			lru_e = e;
 	}
+
+	if (i == SOCKS_CACHE_SLOTS) {
+		if ((e = free_e) == NULL) {
+			e = lru_e;
+			socks_stats.cache_evictions++;
+		}
+		strlcpy(e->host, host, sizeof(e->host));
+	}
+
+	ip4_addr_copy(e->ip, *ip);
+	e->ttl = ip4_addr_isany_val(*ip) ? SOCKS_CACHE_NEG_TTL :
+	    SOCKS_CACHE_TTL;
+	e->added = now;
+	e->used = now;
+}
+
+/* AT$SOCKS?: show what the proxy has been up to */
+void
+socks_dump(void)
+{
+	unsigned long now = millis(), lookups;
+	int i, active = 0, cached = 0;
+
+	for (i = 0; i < socks_nclients; i++)
+		if (!socks_clients[i].done())
+			active++;
+
+	for (i = 0; i < SOCKS_CACHE_SLOTS; i++)
+		if (socks_cache[i].host[0] != '\0' &&
+		    !socks_cache_expired(&socks_cache[i], now))
+			cached++;
+
+	lookups = socks_stats.cache_hits + socks_stats.cache_negative_hits +
+	    socks_stats.cache_misses;
+
+	output("\n");
+	outputf("Sessions:          %d active of %d, %lu total\r\n", active,
+	    socks_nclients, socks_stats.sessions);
+	outputf("Queued:            %d now, %lu dropped\r\n",
+	    socks_queue_len, socks_stats.queue_drops);
+	outputf("Connects:          %lu, %lu failed\r\n",
+	    socks_stats.connects, socks_stats.connect_fails);
+	outputf("Connect time:      %lums avg, %lums max\r\n",
+	    socks_stats.connects ? socks_stats.connect_ms /
+	    socks_stats.connects : 0, socks_stats.connect_ms_max);
+	outputf("TLS handshakes:    %lu, %lu failed\r\n",
+	    socks_stats.handshakes, socks_stats.handshake_fails);
+	outputf("Handshake time:    %lums avg, %lums max\r\n",
+	    socks_stats.handshakes ? socks_stats.handshake_ms /
+	    socks_stats.handshakes : 0, socks_stats.handshake_ms_max);
+	outputf("Name cache hits:   %lu (%lu negative), %lu misses, %lu%%\r\n",
+	    socks_stats.cache_hits + socks_stats.cache_negative_hits,
+	    socks_stats.cache_negative_hits, socks_stats.cache_misses,
+	    lookups ? ((socks_stats.cache_hits +
+	    socks_stats.cache_negative_hits) * 100) / lookups : 0);
+	outputf("Names cached:      %d of %d, %lu evictions\r\n", cached,
+	    SOCKS_CACHE_SLOTS, socks_stats.cache_evictions);
 }
@@ -0,0 +1,197 @@
+/*
+ * WiFiPPP
+ * Copyright (c) 2021 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * AT$SPEEDTEST: measure what actually gets through the serial link, using
+ * the same serial_queue()/serial_read() paths that PPP and telnet use.
+ *
+ * The pattern is a 64-byte line of unique characters, so when receiving,
+ * any byte tells us where in the pattern we should be and we can resync
+ * after an error.
+ */
+
+#include "wifippp.h"
+
+static const char pattern[] = "0123456789"
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz\r\n";
+#define PATTERN_LEN	(sizeof(pattern) - 1)
+
+/* stop receiving once the DTE has gone quiet for this long */
+#define SPEEDTEST_RX_IDLE	(2 * 1000)
+
+static bool speedtest_tx;
+static unsigned long speedtest_secs;
+static unsigned long speedtest_started;
+static unsigned long speedtest_first;
+static unsigned long speedtest_last;
+static unsigned long speedtest_bytes;
+static unsigned long speedtest_errors;
+static unsigned long speedtest_tx_bytes;
+static unsigned long speedtest_rts_wait;
+static unsigned long speedtest_overruns;
+static size_t speedtest_pos;
+
+static void speedtest_finish(void);
+
+bool
+speedtest_start(bool tx, unsigned int secs)
+{
+	if (secs == 0 || secs > 600)
+		return false;
+
+	speedtest_tx = tx;
+	speedtest_secs = secs;
+	speedtest_bytes = 0;
+	speedtest_errors = 0;
+	speedtest_pos = 0;
+	speedtest_first = 0;
+	speedtest_last = 0;
+
+	if (tx)
+		outputf("\nOK sending pattern for %u secs, any key to stop\r\n",
+		    secs);
+	else
+		outputf("\nOK send pattern now, waiting up to %u secs\r\n",
+		    secs);
+
+	/* don't count our own banner */
+	serial_flush();
+
+	speedtest_tx_bytes = serial_stats.tx_bytes;
+	speedtest_rts_wait = serial_stats.rts_wait_ms;
+	speedtest_overruns = serial_stats.rx_overruns;
+	speedtest_started = millis();
+
+	state = STATE_SPEEDTEST;
+	return true;
+}
+
+void
+speedtest_stop(void)
+{
+	if (state == STATE_SPEEDTEST)
+		state = STATE_AT;
+}
+
+void
+speedtest_process(void)
+{
+	unsigned char buf[128];
+	unsigned long now = millis();
+	size_t len, chunk, i;
+	const char *p;
+
+	if (state != STATE_SPEEDTEST) {
+		syslog.logf(LOG_ERR, "%s but state is %d!", __func__, state);
+		return;
+	}
+
+	if (speedtest_tx) {
+		/* any input stops the test early */
+		if (serial_available()) {
+			serial_read(buf, sizeof(buf));
+			speedtest_finish();
+			return;
+		}
+
+		if (now - speedtest_started >= speedtest_secs * 1000) {
+			speedtest_finish();
+			return;
+		}
+
+		/* keep the transmit ring full */
+		while ((len = serial_tx_free()) > 0) {
+			chunk = PATTERN_LEN - speedtest_pos;
+			if (chunk > len)
+				chunk = len;
+			serial_queue((const unsigned char *)pattern +
+			    speedtest_pos, chunk);
+			speedtest_pos = (speedtest_pos + chunk) % PATTERN_LEN;
+		}
+		return;
+	}
+
+	while ((len = serial_read(buf, sizeof(buf))) > 0) {
+		if (!speedtest_first)
+			speedtest_first = now;
+		speedtest_last = now;
+		speedtest_bytes += len;
+
+		for (i = 0; i < len; i++) {
+			if (buf[i] == (unsigned char)pattern[speedtest_pos]) {
+				speedtest_pos = (speedtest_pos + 1) %
+				    PATTERN_LEN;
+				continue;
+			}
+
+			speedtest_errors++;
+
+			/* resync on whatever we got, if it's in the pattern */
+			if (buf[i] && (p = strchr(pattern, buf[i])))
+				speedtest_pos = ((p - pattern) + 1) %
+				    PATTERN_LEN;
+		}
+	}
+
+	if (speedtest_first) {
+		if (now - speedtest_first >= speedtest_secs * 1000 ||
+		    now - speedtest_last >= SPEEDTEST_RX_IDLE)
+			speedtest_finish();
+	} else if (now - speedtest_started >= speedtest_secs * 1000)
+		speedtest_finish();
+}
+
+static void
+speedtest_finish(void)
+{
+	unsigned long bytes, elapsed;
+
+	if (speedtest_tx) {
+		/* only what the UART actually took, not what's still queued */
+		bytes = serial_stats.tx_bytes - speedtest_tx_bytes;
+		elapsed = millis() - speedtest_started;
+	} else {
+		bytes = speedtest_bytes;
+		elapsed = speedtest_last - speedtest_first;
+	}
+
+	state = STATE_AT;
+
+	output("\r\n");
+	outputf("Direction:         %s\r\n", speedtest_tx ? "to DTE" :
+	    "from DTE");
+	outputf("Baud rate:         %d\r\n", Serial.baudRate());
+	outputf("Bytes:             %lu\r\n", bytes);
+	outputf("Elapsed:           %lums\r\n", elapsed);
+	outputf("Throughput:        %lu bytes/s\r\n",
+	    elapsed ? (unsigned long)((uint64_t)bytes * 1000 / elapsed) : 0);
+	if (speedtest_tx)
+		outputf("RTS stall:         %lums\r\n",
+		    serial_stats.rts_wait_ms - speedtest_rts_wait);
+	else {
+		outputf("Byte errors:       %lu\r\n", speedtest_errors);
+		outputf("Receive overruns:  %lu\r\n",
+		    serial_stats.rx_overruns - speedtest_overruns);
+	}
+
+	if (!settings->quiet) {
+		if (settings->verbal)
+			output("OK\r\n");
+		else
+			output("0\r");
+	}
+}
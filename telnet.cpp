@@ -470,6 +470,34 @@ telnet_write(char b)
 	return telnet.write(b);
 }
 
+int
+telnet_write(const unsigned char *buf, size_t len)
+{
+	unsigned char ebuf[128];
+	size_t elen = 0, i;
+	int wrote = 0;
+
+	/* escape into a bounce buffer so this goes out in as few writes */
+	for (i = 0; i < len; i++) {
+		if (settings->telnet && buf[i] == IAC) {
+			TELNET_DATA_DEBUG("telnet_write: escaped IAC");
+			ebuf[elen++] = IAC;
+		}
+		ebuf[elen++] = buf[i];
+		TELNET_DATA_DEBUG("telnet_write: 0x%x", buf[i]);
+
+		if (elen >= sizeof(ebuf) - 1) {
+			wrote += telnet.write(ebuf, elen);
+			elen = 0;
+		}
+	}
+
+	if (elen)
+		wrote += telnet.write(ebuf, elen);
+
+	return wrote;
+}
+
 int
 telnet_write(String s)
 {
@@ -254,6 +254,9 @@ update_process(char *url, bool do_update, bool force)
 	outputf("Updating to version %s (%d bytes) from %s\r\n",
 	    version.c_str(), bytesize, (char *)rom_url.c_str());
 
+	/* progress is written directly, so get everything else out first */
+	serial_flush();
+
 	Update.begin(bytesize, U_FLASH, -1);
 
 	Update.setMD5(md5.c_str());
@@ -291,6 +294,7 @@ update_process(char *url, bool do_update, bool force)
 
 	(tls ? client_tls : client).stop();
 	outputf("\r\nOK update completed, restarting\r\n");
+	serial_flush();
 
 	delay(500);
 	ESP.restart();
@@ -34,6 +34,26 @@ setup(void)
 	    sizeof(settings->magic)) == 0) {
 		/* do migrations if needed based on current revision */
 		if (settings->revision != EEPROM_REVISION) {
+			if (settings->revision < 1) {
+				settings->esc_char = '+';
+				settings->esc_guard = 50;
+			}
+			if (settings->revision < 2)
+				settings->ppp_vj = 1;
+			if (settings->revision < 3)
+				settings->ppp_mss_clamp = 1;
+			if (settings->revision < 4)
+				settings->napt_max = 0;
+			if (settings->revision < 5) {
+				settings->lcp_echo_interval = 10;
+				settings->lcp_echo_fails = 4;
+				settings->ppp_mru = 0;
+			}
+			if (settings->revision < 6)
+				settings->ppp_input_ms = 20;
+			if (settings->revision < 7)
+				settings->ppp_ccp = 1;
+
 			settings->revision = EEPROM_REVISION;
 			EEPROM.commit();
 		}
@@ -51,6 +71,32 @@ setup(void)
 		settings->baud = 9600;
 		settings->autobaud = 1;
 
+		/* S2 and S12, +++ with a 1 second guard time */
+		settings->esc_char = '+';
+		settings->esc_guard = 50;
+
+		/* negotiate VJ header compression */
+		settings->ppp_vj = 1;
+
+		/* keep TCP segments within the PPP MTU */
+		settings->ppp_mss_clamp = 1;
+
+		/* size the NAPT table from free heap */
+		settings->napt_max = 0;
+
+		/* LCP echo every 10 seconds, hang up after 4 go unanswered */
+		settings->lcp_echo_interval = 10;
+		settings->lcp_echo_fails = 4;
+
+		/* take the peer's MRU, and adapt to line errors */
+		settings->ppp_mru = 0;
+
+		/* spend up to 20ms per loop feeding PPP/SLIP input */
+		settings->ppp_input_ms = 20;
+
+		/* negotiate Deflate compression */
+		settings->ppp_ccp = 1;
+
 		/* enable hardware flow control, disable software */
 		settings->reg_r = REG_R_RTS_ON;
 		settings->reg_i = REG_I_XONXOFF_OFF;
@@ -87,6 +133,8 @@ setup(void)
 		WiFi.begin(settings->wifi_ssid, settings->wifi_pass);
 
 	socks_setup();
+	dnsproxy_setup();
+	ppp_setup();
 
 	serial_dsr(true);
 	serial_cts(true);
@@ -138,8 +186,6 @@ int
 output(char c)
 {
 	serial_write(c);
-	if (c == '\n')
-		serial_flush();
 
 	return 0;
 }
@@ -153,8 +199,7 @@ output(const char *str)
 	syslog.logf(LOG_DEBUG, "output: \"%s\"", str);
 #endif
 
-	for (size_t i = 0; i < len; i++)
-		output(str[i]);
+	serial_write((unsigned char *)str, len);
 
 	return 0;
 }
@@ -23,6 +23,7 @@
 #include <ESP8266WiFi.h>
 #include <Syslog.h>
 #include <WiFiUdp.h>
+#include <netif/ppp/ppp.h>
 
 #define WIFIPPP_VERSION		"0.1"
 
@@ -41,7 +42,7 @@ struct __attribute((__packed__)) eeprom_data {
 	char magic[3];
 #define EEPROM_MAGIC_BYTES	"ppp"
 	uint8_t revision;
-#define EEPROM_REVISION		0
+#define EEPROM_REVISION		7
 	char wifi_ssid[64];
 	char wifi_pass[64];
 	uint32_t baud;
@@ -61,11 +62,23 @@ struct __attribute((__packed__)) eeprom_data {
 	uint8_t reg_i;
 #define REG_I_XONXOFF_OFF	0
 #define REG_I_XONXOFF_ON	1
+#define XON			0x11
+#define XOFF			0x13
 	uint8_t echo;
 	uint8_t quiet;
 	uint8_t verbal;
 	uint8_t pixel_brightness;
 	uint8_t autobaud;
+	uint8_t esc_char;
+	uint8_t esc_guard;
+	uint8_t ppp_vj;
+	uint8_t ppp_mss_clamp;
+	uint16_t napt_max;
+	uint8_t lcp_echo_interval;
+	uint8_t lcp_echo_fails;
+	uint16_t ppp_mru;
+	uint8_t ppp_input_ms;
+	uint8_t ppp_ccp;
 };
 
 enum {
@@ -73,6 +86,8 @@ enum {
 	STATE_TELNET,
 	STATE_PPP,
 	STATE_UPDATING,
+	STATE_SPEEDTEST,
+	STATE_SLIP,
 };
 
 extern uint8_t state;
@@ -94,6 +109,77 @@ const int pCTS     = 0; //15, but responds weirdly when used
 const int pRTS     = 0;
 const int pRI      = 0;
 
+/* ccp.cpp */
+struct ccp_stats {
+	unsigned long tx_bytes;
+	unsigned long tx_wire;
+	unsigned long rx_bytes;
+	unsigned long rx_wire;
+	unsigned long tx_resets;
+	unsigned long rx_resets;
+	unsigned long rx_errors;
+};
+extern struct ccp_stats ccp_stats;
+void ccp_reset(void);
+bool ccp_tx_running(void);
+const char *ccp_state(void);
+bool ccp_input(const uint8_t *, size_t);
+void ccp_process(void);
+struct pbuf *ccp_compress(uint16_t, struct pbuf *);
+void ccp_commit(struct pbuf *);
+int ccp_decompress(const uint8_t *, size_t, const uint8_t **);
+void ccp_incomp(uint16_t, const uint8_t *, size_t);
+
+/* dnsproxy.cpp */
+struct dnsproxy_stats {
+	unsigned long queries;
+	unsigned long hits;
+	unsigned long negative_hits;
+	unsigned long misses;
+	unsigned long timeouts;
+	unsigned long evictions;
+	unsigned long errors;
+};
+extern struct dnsproxy_stats dnsproxy_stats;
+void dnsproxy_setup(void);
+void dnsproxy_process(void);
+void dnsproxy_cache_usage(size_t *, size_t *);
+
+/* hdlc.cpp */
+struct hdlc_stats {
+	unsigned long rx_frames;
+	unsigned long rx_bytes;
+	unsigned long rx_escaped;
+	unsigned long rx_fcs_errors;
+	unsigned long rx_discarded;
+	unsigned long rx_nomem;
+	unsigned long tx_frames;
+	unsigned long tx_bytes;
+	unsigned long tx_escaped;
+	unsigned long tx_dropped;
+	unsigned long tx_interactive;
+	unsigned long tx_bulk;
+	unsigned long interactive_wait_max;
+	unsigned long bulk_wait_max;
+	unsigned long codel_drops;
+	unsigned long codel_marks;
+};
+extern struct hdlc_stats hdlc_stats;
+ppp_pcb *hdlc_create(struct netif *, ppp_link_status_cb_fn, void *);
+void hdlc_input(const uint8_t *, size_t);
+err_t hdlc_control(uint16_t, const uint8_t *, size_t);
+void hdlc_process(void);
+void hdlc_bench(void);
+
+/* nat.cpp */
+struct nat_stats {
+	unsigned long flows;
+};
+extern struct nat_stats nat_stats;
+bool nat_setup(void);
+void nat_track(bool, uint16_t, struct pbuf *);
+void nat_dump(void);
+
 /* pixel.cpp */
 void pixel_setup(void);
 void pixel_set_rgb(int, int, int);
@@ -102,7 +188,62 @@ void pixel_color_by_state(void);
 void pixel_adjust_brightness(void);
 
 /* ppp.cpp */
+enum {
+	PPP_STATS_TCP,
+	PPP_STATS_UDP,
+	PPP_STATS_ICMP,
+	PPP_STATS_IP_OTHER,
+	PPP_STATS_CONTROL,
+	PPP_STATS_PROTOS
+};
+
+struct ppp_stats {
+	unsigned long input_passes;
+	unsigned long input_bytes;
+	unsigned long input_pass_max;
+	unsigned long vj_packets;
+	unsigned long vj_compressed;
+	unsigned long vj_compressed_in;
+	unsigned long vj_saved;
+	unsigned long mss_clamped;
+	unsigned long connect_ms;
+	unsigned long connect_ms_max;
+	unsigned long mtu_changes;
+	unsigned long sessions;
+	unsigned long lcp_in;
+	unsigned long lcp_out;
+	unsigned long ipcp_in;
+	unsigned long ipcp_out;
+	unsigned long conf_naks;
+	unsigned long echo_rtt;
+	unsigned long echo_rtt_avg;
+	unsigned long echo_rtt_max;
+	unsigned long bytes_in[PPP_STATS_PROTOS];
+	unsigned long bytes_out[PPP_STATS_PROTOS];
+};
+extern struct ppp_stats ppp_stats;
+/* the current (or last) session, kept apart from resettable stats */
+struct ppp_session {
+	unsigned long start;
+	unsigned long end;
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	unsigned long rate_in;
+	unsigned long rate_out;
+	uint16_t mtu;
+	uint16_t mtu_negotiated;
+};
+extern struct ppp_session ppp_session;
+extern const char *ppp_stats_proto_names[PPP_STATS_PROTOS];
+void ppp_account(bool, uint16_t, struct pbuf *);
+void ppp_session_begin(void);
+void ppp_session_tick(void);
+void ppp_session_end(const char *);
+bool ppp_setup(void);
+void ppp_setup_nat(struct netif *);
 bool ppp_start(void);
+void ppp_clamp_mss(struct pbuf *, uint16_t);
+void ppp_stats_update(void);
 void ppp_process(void);
 void ppp_stop(bool);
 
@@ -110,16 +251,39 @@ void ppp_stop(bool);
 void screen_setup(void);
 
 /* serial.cpp */
+struct serial_stats {
+	unsigned long since;
+	unsigned long rx_bytes;
+	unsigned long tx_bytes;
+	unsigned long rx_rate;
+	unsigned long tx_rate;
+	unsigned long rx_rate_avg;
+	unsigned long tx_rate_avg;
+	unsigned long rx_overruns;
+	unsigned long rx_errors;
+	unsigned long rx_peak;
+	unsigned long rts_wait_ms;
+};
+extern struct serial_stats serial_stats;
 extern const unsigned long ok_bauds[];
 void serial_setup(void);
 void serial_start(int);
+void serial_process(void);
 uint8_t serial_read(void);
-bool serial_available(void);
+size_t serial_read(unsigned char *, size_t);
+size_t serial_available(void);
 int16_t serial_peek(void);
 void serial_write(unsigned char);
 void serial_write(unsigned char *, size_t);
+size_t serial_queue(const unsigned char *, size_t);
+size_t serial_tx_free(void);
+size_t serial_tx_queued(void);
 void serial_flush(void);
-long serial_autobaud(void);
+void serial_stats_reset(void);
+bool serial_baud_ok(unsigned long);
+bool serial_break(void);
+void serial_autobaud(void);
+void serial_autobaud_confirm(bool);
 void serial_cts(bool);
 void serial_dcd(bool);
 void serial_dsr(bool);
@@ -127,9 +291,51 @@ bool serial_dtr(void);
 void serial_ri(bool);
 bool serial_rts(void);
 
+/* slip.cpp */
+struct slip_stats {
+	unsigned long rx_packets;
+	unsigned long rx_bytes;
+	unsigned long rx_compressed;
+	unsigned long rx_errors;
+	unsigned long rx_dropped;
+	unsigned long tx_packets;
+	unsigned long tx_bytes;
+	unsigned long tx_compressed;
+	unsigned long tx_dropped;
+};
+extern struct slip_stats slip_stats;
+bool slip_start(bool);
+void slip_stop(void);
+void slip_process(void);
+
+/* speedtest.cpp */
+bool speedtest_start(bool, unsigned int);
+void speedtest_process(void);
+void speedtest_stop(void);
+
 /* socks.cpp */
+struct socks_stats {
+	unsigned long sessions;
+	unsigned long queue_drops;
+	unsigned long connects;
+	unsigned long connect_fails;
+	unsigned long connect_ms;
+	unsigned long connect_ms_max;
+	unsigned long handshakes;
+	unsigned long handshake_fails;
+	unsigned long handshake_ms;
+	unsigned long handshake_ms_max;
+	unsigned long cache_hits;
+	unsigned long cache_negative_hits;
+	unsigned long cache_misses;
+	unsigned long cache_evictions;
+};
+extern struct socks_stats socks_stats;
 void socks_setup(void);
 void socks_process(void);
+void socks_dump(void);
+bool socks_cache_lookup(const char *, ip4_addr_t *);
+void socks_cache_store(const char *, const ip4_addr_t *);
 
 /* telnet.cpp */
 int telnet_connect(char *, uint16_t);
@@ -137,6 +343,7 @@ bool telnet_connected(void);
 void telnet_disconnect(void);
 int telnet_read(void);
 int telnet_write(char b);
+int telnet_write(const unsigned char *, size_t);
 int telnet_write(String s);
 
 /* update.cpp */
@@ -33,25 +33,41 @@ static char curcmd[64] = { 0 };
 static char lastcmd[64] = { 0 };
 static unsigned char curcmdlen = 0;
 static unsigned char lastcmdlen = 0;
-static unsigned char plusses = 0;
-static unsigned long plus_wait = 0;
 static unsigned long last_dtr = 0;
+static unsigned long dtr_dropped = 0;
 static unsigned long last_autobaud = 0;
 static unsigned long last_pixel_color = 0;
 
+/*
+ * Hayes escape sequence: ESCAPE_COUNT of the S2 character, each within the
+ * S12 guard time of the last, with at least that much silence before and
+ * after.  Only escape characters that could be the start of one are held
+ * back, everything else goes straight through.  A guard time of 0 turns
+ * off the timing checks, so the characters just have to be consecutive.
+ */
+#define ESCAPE_COUNT 3
+static unsigned char escapes = 0;
+static unsigned long last_escape = 0;
+static unsigned long last_online_input = 0;
+
 void
 loop(void)
 {
-	int b = -1, i;
+	unsigned char tbuf[64];
+	size_t tlen;
+	int b = -1;
 	long now = millis();
-	bool hangup = false;
+	unsigned long guard;
+	bool hangup = false, escape = false;
 
 	if (last_pixel_color - now > 500) {
 		pixel_color_by_state();
 		last_pixel_color = now;
 	}
 
+	serial_process();
 	socks_process();
+	dnsproxy_process();
 
 	if (serial_dtr()) {
 		if (!last_dtr) {
@@ -61,18 +77,27 @@ loop(void)
 				    "DTR, doing auto-baud");
 #endif
 				serial_autobaud();
-				now = millis();
 				last_autobaud = now;
 			} else
 				serial_start(settings->baud);
+		} else if (dtr_dropped) {
+			/* DTR dropped briefly, go to command mode */
+			escape = true;
 		}
 		last_dtr = now;
+		dtr_dropped = 0;
 	} else if (last_dtr && (now - last_dtr > 1750)) {
 		/* had DTR, dropped it for 1.75 secs, hangup */
 		hangup = true;
 		last_dtr = 0;
+		dtr_dropped = 0;
 		syslog.log(LOG_DEBUG, "dropped DTR, hanging up");
-	}
+	} else if (last_dtr && !dtr_dropped)
+		dtr_dropped = now;
+
+	/* a BREAK also gets us back to command mode */
+	if (serial_break())
+		escape = true;
 
 	switch (state) {
 	case STATE_AT:
@@ -85,6 +110,9 @@ loop(void)
 			syslog.logf(LOG_DEBUG, "bogus char: 0x%x (%c)", b, b);
 #endif
 			if (b > 127) {
+				/* we may have auto-detected the wrong rate */
+				serial_autobaud_confirm(false);
+
 				/*
 				 * Help modem auto-detection by just spitting
 				 * out OK in response to hopefully ATs received
@@ -114,6 +142,10 @@ loop(void)
 			return;
 		}
 
+		if (curcmdlen == 1)
+			/* got an AT, so we're at the right baud rate */
+			serial_autobaud_confirm(true);
+
 		switch (b) {
 		case '\n':
 		case '\r':
@@ -155,52 +187,69 @@ loop(void)
 		}
 		break;
 	case STATE_TELNET:
-		b = -1;
-
 		if (hangup) {
 			telnet_disconnect();
 			break;
 		}
 
-		if (serial_available())
+		/* pass along input, holding back a possible escape sequence */
+		guard = settings->esc_guard * 20;
+		tlen = 0;
+		while (tlen + ESCAPE_COUNT + 1 <= sizeof(tbuf) &&
+		    serial_available()) {
 			b = serial_read();
-
-		if (b == -1 && plus_wait > 0 && (millis() - plus_wait) >= 500) {
-			/* received no input within 500ms of a plus */
-			if (plusses >= 3) {
-				state = STATE_AT;
-				if (!settings->quiet) {
-					if (settings->verbal)
-						output("\r\nOK\r\n");
-					else
-						output("0\r");
-				}
+			now = millis();
+
+			if (b == settings->esc_char && b <= 127 &&
+			    escapes < ESCAPE_COUNT && (guard == 0 ||
+			    (escapes ? (now - last_escape < guard) :
+			    (now - last_online_input >= guard)))) {
+				escapes++;
+				last_escape = now;
 			} else {
-				/* cancel, flush any plus signs received */
-				for (i = 0; i < plusses; i++)
-					telnet_write("+");
-			}
-			plusses = 0;
-			plus_wait = 0;
-		} else if (b != -1) {
-			if (b == '+') {
-				plusses++;
-				plus_wait = millis();
-				break;
+				for (; escapes; escapes--)
+					tbuf[tlen++] = settings->esc_char;
+				tbuf[tlen++] = b;
 			}
 
-			if (plusses) {
-				for (i = 0; i < plusses; i++)
-					telnet_write("+");
-				plusses = 0;
+			last_online_input = now;
+		}
+
+		if (escapes && (guard == 0 ? escapes == ESCAPE_COUNT :
+		    millis() - last_escape >= guard)) {
+			if (escapes == ESCAPE_COUNT)
+				/* and now the trailing guard time */
+				escape = true;
+			else {
+				/* too slow, not an escape sequence */
+				for (; escapes; escapes--)
+					tbuf[tlen++] = settings->esc_char;
+			}
+		}
+
+		if (tlen)
+			telnet_write(tbuf, tlen);
+
+		if (escape) {
+			escapes = 0;
+			state = STATE_AT;
+			if (!settings->quiet) {
+				if (settings->verbal)
+					output("\r\nOK\r\n");
+				else
+					output("0\r");
 			}
-			plus_wait = 0;
-			telnet_write(b);
 			break;
 		}
 
-		if ((b = telnet_read()) != -1) {
-			serial_write(b);
+		/* pass along as much as the transmit ring can hold */
+		tlen = 0;
+		while (tlen < sizeof(tbuf) && tlen < serial_tx_free() &&
+		    (b = telnet_read()) != -1)
+			tbuf[tlen++] = b;
+
+		if (tlen) {
+			serial_queue(tbuf, tlen);
 			return;
 		} else if (!telnet_connected()) {
 			if (!settings->quiet) {
@@ -221,6 +270,22 @@ loop(void)
 
 		ppp_process();
 		break;
+	case STATE_SLIP:
+		if (hangup) {
+			slip_stop();
+			break;
+		}
+
+		slip_process();
+		break;
+	case STATE_SPEEDTEST:
+		if (hangup) {
+			speedtest_stop();
+			break;
+		}
+
+		speedtest_process();
+		break;
 	}
 }
 
@@ -277,7 +342,9 @@ parse_cmd:
 
 	/* find optional single digit after command, defaulting to 0 */
 	cmd_num = 0;
-	if (cmd[0] >= '0' && cmd[0] <= '9') {
+	if (cmd_char == 's') {
+		/* S-registers take multiple digits, parsed below */
+	} else if (cmd[0] >= '0' && cmd[0] <= '9') {
 		if (cmd[1] >= '0' && cmd[1] <= '9')
 			/* nothing uses more than 1 digit */
 			goto error;
@@ -323,6 +390,14 @@ parse_cmd:
 			}
 			break;
 		case 's':
+			if (strncmp(lcmd, "slip", 4) == 0) {
+				/* ATDSLIP, like ATDPPP below */
+				host = ohost = strdup("slip");
+				if (host == NULL)
+					goto error;
+				break;
+			}
+
 			/* ATDS: dial a stored host */
 			if (sscanf(lcmd, "s%d", &index) != 1)
 				goto error;
@@ -371,6 +446,15 @@ parse_cmd:
 			} else
 				goto error;
 			break;
+		case 'c':
+			/* ATDCSLIP, like ATDPPP */
+			if (strncmp(lcmd, "cslip", 5) == 0) {
+				host = ohost = strdup("cslip");
+				if (host == NULL)
+					goto error;
+			} else
+				goto error;
+			break;
 		default:
 			goto error;
 		}
@@ -398,8 +482,8 @@ parse_cmd:
 
 			telnet_disconnect();
 			if (ppp_start())
-				/* ppp_begin outputs CONNECT line, since it has
-				 * to do so before calling ppp_listen */
+				/* ppp_start outputs CONNECT line, since it has
+				 * to do so before calling ppp_connect */
 				state = STATE_PPP;
 			else if (!settings->quiet) {
 				if (settings->verbal)
@@ -407,6 +491,28 @@ parse_cmd:
 				else
 					output("8\r");
 			}
+		} else if (strcasecmp(host, "slip") == 0 ||
+		    strcasecmp(host, "cslip") == 0) {
+			bool cslip = (strcasecmp(host, "cslip") == 0);
+			ip4_addr_t t_addr;
+			ip_addr_copy(t_addr, settings->ppp_server_ip);
+			if (!settings->quiet) {
+				if (settings->verbal)
+					outputf("\nDIALING %s:%s\r\n",
+					    ipaddr_ntoa(&t_addr),
+					    cslip ? "CSLIP" : "SLIP");
+			}
+
+			telnet_disconnect();
+			if (slip_start(cslip))
+				/* slip_start outputs CONNECT line too */
+				state = STATE_SLIP;
+			else if (!settings->quiet) {
+				if (settings->verbal)
+					output("NO ANSWER\r\n");
+				else
+					output("8\r");
+			}
 		} else {
 			if (!settings->quiet && settings->verbal)
 				outputf("\nDIALING %s:%d\r\n", host, port);
@@ -562,6 +668,174 @@ parse_cmd:
 			did_nl = true;
 			break;
 		}
+		case 6:
+			/* ATI6: show serial link statistics */
+			output("\n");
+
+			outputf("Current baud rate: %d\r\n", Serial.baudRate());
+			outputf("Stats since:       %lu secs ago\r\n",
+			    (millis() - serial_stats.since) / 1000);
+			outputf("Bytes in:          %lu\r\n",
+			    serial_stats.rx_bytes);
+			outputf("Bytes out:         %lu\r\n",
+			    serial_stats.tx_bytes);
+			outputf("Rate in:           %lu/s (%lu/s over 60s)\r\n",
+			    serial_stats.rx_rate, serial_stats.rx_rate_avg);
+			outputf("Rate out:          %lu/s (%lu/s over 60s)\r\n",
+			    serial_stats.tx_rate, serial_stats.tx_rate_avg);
+			outputf("Receive overruns:  %lu\r\n",
+			    serial_stats.rx_overruns);
+			outputf("Framing errors:    %lu\r\n",
+			    serial_stats.rx_errors);
+			outputf("Peak rx buffered:  %lu\r\n",
+			    serial_stats.rx_peak);
+			outputf("Time waiting RTS:  %lums\r\n",
+			    serial_stats.rts_wait_ms);
+
+			did_nl = true;
+			break;
+		case 7: {
+			/* ATI7: show PPP statistics */
+			unsigned long secs;
+			char label[20];
+			bool online;
+
+			ppp_stats_update();
+			output("\n");
+
+			online = (state == STATE_PPP || state == STATE_SLIP);
+			secs = ((online ? millis() : ppp_session.end) -
+			    ppp_session.start) / 1000;
+			outputf("Sessions:          %lu\r\n",
+			    ppp_stats.sessions);
+			outputf("Session uptime:    %lu secs%s\r\n", secs,
+			    online ? "" : " (ended)");
+			outputf("Session in:        %lu bytes, %lu/s now, "
+			    "%lu/s avg\r\n", ppp_session.bytes_in,
+			    ppp_session.rate_in,
+			    secs ? ppp_session.bytes_in / secs : 0);
+			outputf("Session out:       %lu bytes, %lu/s now, "
+			    "%lu/s avg\r\n", ppp_session.bytes_out,
+			    ppp_session.rate_out,
+			    secs ? ppp_session.bytes_out / secs : 0);
+			outputf("Negotiation time:  %lums (max %lums)\r\n",
+			    ppp_stats.connect_ms, ppp_stats.connect_ms_max);
+			outputf("Link MTU:          %u (negotiated %u, %s, "
+			    "%lu changes)\r\n", ppp_session.mtu,
+			    ppp_session.mtu_negotiated,
+			    settings->ppp_mru ? "fixed" : "adaptive",
+			    ppp_stats.mtu_changes);
+			outputf("LCP packets:       %lu in, %lu out\r\n",
+			    ppp_stats.lcp_in, ppp_stats.lcp_out);
+			outputf("IPCP packets:      %lu in, %lu out\r\n",
+			    ppp_stats.ipcp_in, ppp_stats.ipcp_out);
+			outputf("Config Nak/Rej:    %lu\r\n",
+			    ppp_stats.conf_naks);
+			outputf("LCP echo RTT:      %lums (avg %lums, "
+			    "max %lums)\r\n", ppp_stats.echo_rtt,
+			    ppp_stats.echo_rtt_avg, ppp_stats.echo_rtt_max);
+			for (int i = 0; i < PPP_STATS_PROTOS; i++) {
+				snprintf(label, sizeof(label), "%s bytes:",
+				    ppp_stats_proto_names[i]);
+				outputf("%-19s%lu in, %lu out\r\n", label,
+				    ppp_stats.bytes_in[i],
+				    ppp_stats.bytes_out[i]);
+			}
+			outputf("Input passes:      %lu\r\n",
+			    ppp_stats.input_passes);
+			outputf("Input bytes:       %lu\r\n",
+			    ppp_stats.input_bytes);
+			outputf("Bytes per pass:    %lu (max %lu)\r\n",
+			    ppp_stats.input_passes ? ppp_stats.input_bytes /
+			    ppp_stats.input_passes : 0,
+			    ppp_stats.input_pass_max);
+			outputf("Frames in:         %lu (%lu escapes)\r\n",
+			    hdlc_stats.rx_frames, hdlc_stats.rx_escaped);
+			outputf("FCS errors:        %lu\r\n",
+			    hdlc_stats.rx_fcs_errors);
+			outputf("Frames discarded:  %lu\r\n",
+			    hdlc_stats.rx_discarded);
+			outputf("Frames lost (mem): %lu\r\n",
+			    hdlc_stats.rx_nomem);
+			outputf("Frames out:        %lu (%lu escapes)\r\n",
+			    hdlc_stats.tx_frames, hdlc_stats.tx_escaped);
+			outputf("Output bytes:      %lu\r\n",
+			    hdlc_stats.tx_bytes);
+			outputf("Interactive out:   %lu frames, "
+			    "max wait %lums\r\n",
+			    hdlc_stats.tx_interactive,
+			    hdlc_stats.interactive_wait_max);
+			outputf("Bulk out:          %lu frames, "
+			    "max wait %lums\r\n",
+			    hdlc_stats.tx_bulk, hdlc_stats.bulk_wait_max);
+			outputf("Queue drops:       %lu full, %lu CoDel, "
+			    "%lu ECN marked\r\n", hdlc_stats.tx_dropped,
+			    hdlc_stats.codel_drops, hdlc_stats.codel_marks);
+			outputf("VJ compression:    %s\r\n",
+			    settings->ppp_vj ? "on" : "off");
+			outputf("VJ compressed:     %lu of %lu out, %lu in\r\n",
+			    ppp_stats.vj_compressed, ppp_stats.vj_packets,
+			    ppp_stats.vj_compressed_in);
+			outputf("VJ bytes saved:    ~%lu\r\n",
+			    ppp_stats.vj_saved);
+			outputf("Deflate:           %s\r\n", ccp_state());
+			outputf("Deflate out:       %lu bytes sent as %lu "
+			    "(%lu%%), %lu resets\r\n", ccp_stats.tx_bytes,
+			    ccp_stats.tx_wire, ccp_stats.tx_bytes ?
+			    (unsigned long)((uint64_t)ccp_stats.tx_wire * 100 /
+			    ccp_stats.tx_bytes) : 100, ccp_stats.tx_resets);
+			outputf("Deflate in:        %lu bytes received as %lu "
+			    "(%lu%%), %lu resets, %lu errors\r\n",
+			    ccp_stats.rx_bytes, ccp_stats.rx_wire,
+			    ccp_stats.rx_bytes ?
+			    (unsigned long)((uint64_t)ccp_stats.rx_wire * 100 /
+			    ccp_stats.rx_bytes) : 100, ccp_stats.rx_resets,
+			    ccp_stats.rx_errors);
+			outputf("MSS clamping:      %s, %lu SYNs clamped\r\n",
+			    settings->ppp_mss_clamp ? "on" : "off",
+			    ppp_stats.mss_clamped);
+			outputf("SLIP packets in:   %lu (%lu CSLIP), "
+			    "%lu errors, %lu dropped\r\n",
+			    slip_stats.rx_packets, slip_stats.rx_compressed,
+			    slip_stats.rx_errors, slip_stats.rx_dropped);
+			outputf("SLIP packets out:  %lu (%lu CSLIP), "
+			    "%lu dropped\r\n", slip_stats.tx_packets,
+			    slip_stats.tx_compressed, slip_stats.tx_dropped);
+
+			did_nl = true;
+			break;
+		}
+		case 8: {
+			/* ATI8: show DNS forwarder statistics */
+			size_t entries, bytes;
+
+			dnsproxy_cache_usage(&entries, &bytes);
+			output("\n");
+
+			outputf("Queries:           %lu\r\n",
+			    dnsproxy_stats.queries);
+			outputf("Cache hits:        %lu (%lu negative)\r\n",
+			    dnsproxy_stats.hits + dnsproxy_stats.negative_hits,
+			    dnsproxy_stats.negative_hits);
+			outputf("Cache misses:      %lu\r\n",
+			    dnsproxy_stats.misses);
+			outputf("Upstream timeouts: %lu\r\n",
+			    dnsproxy_stats.timeouts);
+			outputf("Errors:            %lu\r\n",
+			    dnsproxy_stats.errors);
+			outputf("Cached:            %zu answers, %zu bytes\r\n",
+			    entries, bytes);
+			outputf("Evictions:         %lu\r\n",
+			    dnsproxy_stats.evictions);
+
+			did_nl = true;
+			break;
+		}
+		case 9:
+			/* ATI9: show NAPT translations */
+			nat_dump();
+			did_nl = true;
+			break;
 		default:
 			goto error;
 		}
@@ -593,6 +867,51 @@ parse_cmd:
 			goto error;
 		}
 		break;
+	case 's': {
+		/* ATSn=v or ATSn?: set or show an S-register */
+		unsigned int reg, val;
+		uint8_t *sreg;
+		int chars = 0;
+		bool query;
+
+		if (sscanf(lcmd, "%u=%u%n", &reg, &val, &chars) == 2 &&
+		    chars > 0)
+			query = false;
+		else if (sscanf(lcmd, "%u?%n", &reg, &chars) == 1 && chars > 0)
+			query = true;
+		else
+			goto error;
+
+		switch (reg) {
+		case 2:
+			/* escape character, > 127 disables */
+			sreg = &settings->esc_char;
+			break;
+		case 12:
+			/* escape guard time, 1/50ths of a second, 0 for none */
+			sreg = &settings->esc_guard;
+			break;
+		default:
+			errstr = strdup("unsupported register");
+			goto error;
+		}
+
+		if (query) {
+			outputf("\n%03u\r\n", *sreg);
+			did_nl = true;
+		} else {
+			if (val > 255) {
+				errstr = strdup("invalid value");
+				goto error;
+			}
+			*sreg = val;
+		}
+
+		len -= chars;
+		cmd += chars;
+		lcmd += chars;
+		break;
+	}
 	case 'v':
 		/* ATV/ATV0 or ATV1: enable or disable verbal responses */
 		switch (cmd_num) {
@@ -619,6 +938,7 @@ parse_cmd:
 				else
 					output("0\r");
 			}
+			serial_flush();
 			ESP.restart();
 			/* NOTREACHED */
 		default:
@@ -639,7 +959,7 @@ parse_cmd:
 			did_nl = true;
 		} else if (strncmp(lcmd, "baud=", 5) == 0) {
 			uint32_t baud = 0;
-			int i, chars = 0;
+			int chars = 0;
 
 			/* AT$BAUD=...: set baud rate */
 			if (sscanf(lcmd, "baud=%d%n", &baud, &chars) != 1 ||
@@ -648,14 +968,9 @@ parse_cmd:
 				goto error;
 			}
 
-			for (i = 0; ; i++) {
-				if (ok_bauds[i] == 0) {
-					errstr = strdup("unsupported baud "
-					    "rate");
-					goto error;
-				}
-				if (ok_bauds[i] == baud)
-					break;
+			if (!serial_baud_ok(baud)) {
+				errstr = strdup("unsupported baud rate");
+				goto error;
 			}
 
 			settings->baud = baud;
@@ -672,10 +987,41 @@ parse_cmd:
 			/* AT$BAUD?: print default baud rate */
 			outputf("\n%d\r\n", settings->baud);
 			did_nl = true;
+		} else if (strcmp(lcmd, "bench") == 0) {
+			/* AT$BENCH: time PPP framing on this CPU */
+			hdlc_bench();
+			did_nl = true;
+		} else if (strcmp(lcmd, "ccp=0") == 0) {
+			/* AT$CCP=0: disable PPP Deflate compression */
+			settings->ppp_ccp = 0;
+		} else if (strcmp(lcmd, "ccp=1") == 0) {
+			/* AT$CCP=1: enable PPP Deflate compression */
+			settings->ppp_ccp = 1;
+		} else if (strcmp(lcmd, "ccp?") == 0) {
+			/* AT$CCP?: show PPP Deflate compression setting */
+			outputf("\n%d\r\n", settings->ppp_ccp);
+			did_nl = true;
 		} else if (strcmp(lcmd, "led?") == 0) {
 			/* AT$LED?: show pixel brightness setting */
 			outputf("\n%d\r\n", settings->pixel_brightness);
 			did_nl = true;
+		} else if (strncmp(lcmd, "lcpecho=", 8) == 0) {
+			/* AT$LCPECHO=secs,fails: LCP keepalive, 0 to disable */
+			int secs, fails = settings->lcp_echo_fails, chars = 0;
+			if (sscanf(lcmd, "lcpecho=%d%n,%d%n", &secs, &chars,
+			    &fails, &chars) < 1 || chars == 0 ||
+			    lcmd[chars] != '\0' || secs < 0 || secs > 255 ||
+			    fails < 1 || fails > 255) {
+				errstr = strdup("invalid interval or failures");
+				goto error;
+			}
+			settings->lcp_echo_interval = secs;
+			settings->lcp_echo_fails = fails;
+		} else if (strcmp(lcmd, "lcpecho?") == 0) {
+			/* AT$LCPECHO?: show LCP keepalive settings */
+			outputf("\n%d,%d\r\n", settings->lcp_echo_interval,
+			    settings->lcp_echo_fails);
+			did_nl = true;
 		} else if (strncmp(lcmd, "led=", 4) == 0) {
 			/* AT$LED=n: set pixel brightness */
 			int br, chars;
@@ -687,6 +1033,46 @@ parse_cmd:
 			}
 			settings->pixel_brightness = br;
 			pixel_adjust_brightness();
+		} else if (strncmp(lcmd, "mru=", 4) == 0) {
+			/* AT$MRU=n: fixed PPP MRU, 0 to adapt to line errors */
+			int mru, chars;
+			if (sscanf(lcmd, "mru=%d%n", &mru, &chars) != 1 ||
+			    chars == 0 || lcmd[chars] != '\0' ||
+			    (mru != 0 && (mru < 128 || mru > PPP_MRU))) {
+				errstr = strdup("MRU must be 0 or between 128 "
+				    "and 1500");
+				goto error;
+			}
+			settings->ppp_mru = mru;
+		} else if (strcmp(lcmd, "mru?") == 0) {
+			/* AT$MRU?: show PPP MRU setting */
+			outputf("\n%d\r\n", settings->ppp_mru);
+			did_nl = true;
+		} else if (strcmp(lcmd, "mss=0") == 0) {
+			/* AT$MSS=0: don't clamp TCP MSS to the PPP MTU */
+			settings->ppp_mss_clamp = 0;
+		} else if (strcmp(lcmd, "mss=1") == 0) {
+			/* AT$MSS=1: clamp TCP MSS to the PPP MTU */
+			settings->ppp_mss_clamp = 1;
+		} else if (strcmp(lcmd, "mss?") == 0) {
+			/* AT$MSS?: show TCP MSS clamping setting */
+			outputf("\n%d\r\n", settings->ppp_mss_clamp);
+			did_nl = true;
+		} else if (strncmp(lcmd, "napt=", 5) == 0) {
+			/* AT$NAPT=n: NAPT table size, 0 for automatic */
+			int n, chars;
+			if (sscanf(lcmd, "napt=%d%n", &n, &chars) != 1 ||
+			    chars == 0 || lcmd[chars] != '\0' || n < 0 ||
+			    n > 0xffff) {
+				errstr = strdup("invalid size");
+				goto error;
+			}
+			/* the table is allocated at boot, so needs a restart */
+			settings->napt_max = n;
+		} else if (strcmp(lcmd, "napt?") == 0) {
+			/* AT$NAPT?: show NAPT table size setting */
+			outputf("\n%d\r\n", settings->napt_max);
+			did_nl = true;
 		} else if (strncmp(lcmd, "naws=", 5) == 0) {
 			/* AT$NAWS=: set telnet NAWS */
 			int w, h, chars;
@@ -737,6 +1123,21 @@ parse_cmd:
 			/* AT$PASS?: print wep/wpa passphrase */
 			outputf("\n%s\r\n", settings->wifi_pass);
 			did_nl = true;
+		} else if (strncmp(lcmd, "pppbudget=", 10) == 0) {
+			/* AT$PPPBUDGET=ms: time to spend on input per pass */
+			int ms, chars;
+			if (sscanf(lcmd, "pppbudget=%d%n", &ms, &chars) != 1 ||
+			    chars == 0 || lcmd[chars] != '\0' || ms < 1 ||
+			    ms > 250) {
+				errstr = strdup("budget must be between 1 and "
+				    "250 ms");
+				goto error;
+			}
+			settings->ppp_input_ms = ms;
+		} else if (strcmp(lcmd, "pppbudget?") == 0) {
+			/* AT$PPPBUDGET?: show PPP input time budget */
+			outputf("\n%d\r\n", settings->ppp_input_ms);
+			did_nl = true;
 		} else if (strncmp(lcmd, "pppc=", 5) == 0) {
 			/* AT$PPPC=...: store PPP client IP */
 			ip4_addr_t t_addr;
@@ -765,12 +1166,50 @@ parse_cmd:
 			ip_addr_copy(settings->ppp_server_ip, t_addr);
 			/* re-bind to the new ip */
 			socks_setup();
+			dnsproxy_setup();
 		} else if (strcmp(lcmd, "ppps?") == 0) {
 			/* AT$PPPS?: print PPP server IP */
 			ip4_addr_t t_addr;
 			ip_addr_copy(t_addr, settings->ppp_server_ip);
 			outputf("\n%s\r\n", ipaddr_ntoa(&t_addr));
 			did_nl = true;
+		} else if (strcmp(lcmd, "socks?") == 0) {
+			/* AT$SOCKS?: show SOCKS proxy statistics */
+			socks_dump();
+			did_nl = true;
+		} else if (strcmp(lcmd, "speedtest") == 0 ||
+		    strncmp(lcmd, "speedtest=", 10) == 0) {
+			/* AT$SPEEDTEST[=TX|RX[,secs]]: test DTE throughput */
+			unsigned int secs = 10;
+			bool tx = true;
+			char *arg = lcmd + 9;
+
+			if (arg[0] == '=') {
+				arg++;
+				if (strncmp(arg, "tx", 2) == 0)
+					tx = true;
+				else if (strncmp(arg, "rx", 2) == 0)
+					tx = false;
+				else {
+					errstr = strdup("must be TX or RX");
+					goto error;
+				}
+				arg += 2;
+
+				if (arg[0] == ',' &&
+				    sscanf(arg, ",%u", &secs) != 1) {
+					errstr = strdup("invalid seconds");
+					goto error;
+				} else if (arg[0] != ',' && arg[0] != '\0')
+					goto error;
+			}
+
+			if (!speedtest_start(tx, secs)) {
+				errstr = strdup("seconds must be between 1 and "
+				    "600");
+				goto error;
+			}
+			did_response = true;
 		} else if (strncmp(lcmd, "ssid=", 5) == 0) {
 			/* AT$SSID=...: set wifi ssid */
 			memset(settings->wifi_ssid, 0,
@@ -786,6 +1225,16 @@ parse_cmd:
 			/* AT$SSID?: print wifi ssid */
 			outputf("\n%s\r\n", settings->wifi_ssid);
 			did_nl = true;
+		} else if (strcmp(lcmd, "stats!") == 0) {
+			/* AT$STATS!: reset statistics counters */
+			serial_stats_reset();
+			memset(&ppp_stats, 0, sizeof(ppp_stats));
+			memset(&hdlc_stats, 0, sizeof(hdlc_stats));
+			memset(&ccp_stats, 0, sizeof(ccp_stats));
+			memset(&dnsproxy_stats, 0, sizeof(dnsproxy_stats));
+			memset(&nat_stats, 0, sizeof(nat_stats));
+			memset(&slip_stats, 0, sizeof(slip_stats));
+			memset(&socks_stats, 0, sizeof(socks_stats));
 		} else if (strncmp(lcmd, "syslog=", 7) == 0) {
 			/* AT$SYSLOG=...: set syslog server */
 			memset(settings->syslog_server, 0,
@@ -831,6 +1280,16 @@ parse_cmd:
 				url = lcmd + 7;
 			update_process(url, true, false);
 			did_response = true;
+		} else if (strcmp(lcmd, "vj=0") == 0) {
+			/* AT$VJ=0: disable PPP VJ header compression */
+			settings->ppp_vj = 0;
+		} else if (strcmp(lcmd, "vj=1") == 0) {
+			/* AT$VJ=1: enable PPP VJ header compression */
+			settings->ppp_vj = 1;
+		} else if (strcmp(lcmd, "vj?") == 0) {
+			/* AT$VJ?: show PPP VJ header compression setting */
+			outputf("\n%d\r\n", settings->ppp_vj);
+			did_nl = true;
 		} else
 			goto error;
 
@@ -864,6 +1323,40 @@ parse_cmd:
 		}
 
 		switch (cmd_char) {
+		case 'i':
+			/* AT&I: software (XON/XOFF) flow control */
+			switch (cmd_num) {
+			case 0:
+				settings->reg_i = REG_I_XONXOFF_OFF;
+				break;
+			case 1:
+				settings->reg_i = REG_I_XONXOFF_ON;
+				break;
+			case '?':
+				outputf("\n%d\r\n", settings->reg_i);
+				did_nl = true;
+				break;
+			default:
+				goto error;
+			}
+			break;
+		case 'r':
+			/* AT&R: hardware (RTS/CTS) flow control */
+			switch (cmd_num) {
+			case 1:
+				settings->reg_r = REG_R_RTS_OFF;
+				break;
+			case 2:
+				settings->reg_r = REG_R_RTS_ON;
+				break;
+			case '?':
+				outputf("\n%d\r\n", settings->reg_r);
+				did_nl = true;
+				break;
+			default:
+				goto error;
+			}
+			break;
 		case 'w':
 			switch (cmd_num) {
 			case 0:
@@ -921,6 +1414,55 @@ parse_cmd:
 			goto error;
 		}
 		break;
+	case '+':
+		/* V.250 extended commands, all consume the rest of the input */
+		if (strcmp(lcmd, "ipr?") == 0) {
+			/* AT+IPR?: show current baud rate */
+			outputf("\n+IPR: %d\r\n", Serial.baudRate());
+			did_nl = true;
+		} else if (strcmp(lcmd, "ipr=?") == 0) {
+			/* AT+IPR=?: list supported baud rates, 0 is auto */
+			output("\n+IPR: (0");
+			for (int i = 0; ok_bauds[i] != 0; i++)
+				outputf(",%lu", ok_bauds[i]);
+			output(")\r\n");
+			did_nl = true;
+		} else if (strncmp(lcmd, "ipr=", 4) == 0) {
+			/* AT+IPR=...: switch baud rate for this session */
+			uint32_t baud = 0;
+			int chars = 0;
+
+			if (sscanf(lcmd, "ipr=%u%n", &baud, &chars) != 1 ||
+			    chars == 0) {
+				errstr = strdup("invalid baud rate");
+				goto error;
+			}
+
+			if (baud != 0 && !serial_baud_ok(baud)) {
+				errstr = strdup("unsupported baud rate");
+				goto error;
+			}
+
+			/* respond at the old rate before switching */
+			if (!settings->quiet) {
+				if (settings->verbal)
+					output("\nOK\r\n");
+				else
+					output("0\r");
+			}
+			did_response = true;
+			serial_flush();
+
+			if (baud == 0)
+				serial_autobaud();
+			else
+				serial_start(baud);
+		} else
+			goto error;
+
+		/* consume all chars */
+		len = 0;
+		break;
 	case ' ':
 		/* skip spaces between commands */
 		break;